@@ -0,0 +1,433 @@
+/* Copyright (c) 2011 Derrick Coetzee, Guillaume Cottenceau, and contributors
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Based on code distributed by Guillaume Cottenceau and contributors
+under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
+*/
+
+#include "cache.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/* Results are stored as <cache dir>/<key>.png, where the key combines a
+   hash of the input file's bytes with a hash of the scaling parameters.
+   Entries are written to a temporary file and renamed into place, so
+   concurrent readers never see a partial entry. The modification time
+   of an entry is bumped on every hit and the least recently used
+   entries are evicted once the directory exceeds its size bound.
+
+   The total size of the entries is kept in USAGE_FILE_NAME, updated
+   under an exclusive lock by every insert, so the directory only has to
+   be listed when the bound may have been passed. Eviction goes down to
+   EVICT_TO_PERCENT of the bound, so that a full cache isn't listed again
+   on every insert. The recorded total can only overestimate (entries
+   removed by hand, two inserts of one key), which at worst causes an
+   early listing that corrects it. */
+
+#define READ_CHUNK_SIZE  (1 << 16)
+#define USAGE_FILE_NAME  ".usage"
+#define EVICT_TO_PERCENT 90
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define ROTL64(x,r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+struct cache_entry
+{
+    char name[CACHE_KEY_SIZE + 4];
+    off_t size;
+    time_t mtime;
+};
+
+static uint64_t read_u64(const unsigned char* p);
+static uint64_t hash_round(uint64_t acc, uint64_t input);
+static uint64_t hash_merge_round(uint64_t acc, uint64_t val);
+static uint64_t hash64(const unsigned char* p, size_t len, uint64_t seed);
+static int copy_stream(FILE* from, FILE* to);
+static int copy_file(const char* from_file_name, FILE* to);
+static int is_entry_name(const char* name);
+static int compare_entry_mtime(const void* a, const void* b);
+static struct cache_entry* list_entries(const char* cache_dir, int* count, uint64_t* total_bytes);
+static int read_usage(int fd, uint64_t* total_bytes);
+static void write_usage(int fd, uint64_t total_bytes);
+static uint64_t evict_entries(const char* cache_dir, uint64_t max_bytes);
+
+uint64_t read_u64(const unsigned char* p)
+{
+    uint64_t result;
+    memcpy(&result, p, sizeof(result));
+    return result;
+}
+
+uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = ROTL64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+uint64_t hash_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= hash_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* XXH64 - processes 32 bytes per step in four independent lanes */
+uint64_t hash64(const unsigned char* p, size_t len, uint64_t seed)
+{
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        do {
+            v1 = hash_round(v1, read_u64(p));
+            v2 = hash_round(v2, read_u64(p + 8));
+            v3 = hash_round(v3, read_u64(p + 16));
+            v4 = hash_round(v4, read_u64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        h = hash_merge_round(h, v1);
+        h = hash_merge_round(h, v2);
+        h = hash_merge_round(h, v3);
+        h = hash_merge_round(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += len;
+    while (p + 8 <= end) {
+        h ^= hash_round(0, read_u64(p));
+        h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(k));
+        h ^= k * PRIME64_1;
+        h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * PRIME64_5;
+        h = ROTL64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Hashes the input file in fixed-size chunks, chaining each chunk's
+   hash into the seed of the next, so memory use is bounded. */
+void cache_make_key(const char* read_file_name, const char* params, char* key)
+{
+    FILE* fp = fopen(read_file_name, "rb");
+    if (!fp) {
+        abort_("File %s could not be opened for reading", read_file_name);
+    }
+    unsigned char* buffer = (unsigned char*) malloc(READ_CHUNK_SIZE);
+    if (!buffer) {
+        abort_("Failed to allocate memory to hash input file");
+    }
+
+    uint64_t file_hash = 0;
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer, 1, READ_CHUNK_SIZE, fp)) > 0) {
+        file_hash = hash64(buffer, bytes_read, file_hash);
+    }
+    if (ferror(fp)) {
+        abort_("Error while reading %s", read_file_name);
+    }
+    fclose(fp);
+    free(buffer);
+
+    uint64_t params_hash = hash64((const unsigned char*)params, strlen(params), 0);
+    snprintf(key, CACHE_KEY_SIZE, "%016llx%016llx",
+             (unsigned long long)file_hash, (unsigned long long)params_hash);
+}
+
+int copy_stream(FILE* from, FILE* to)
+{
+    char buffer[READ_CHUNK_SIZE];
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+        if (fwrite(buffer, 1, bytes_read, to) != bytes_read) {
+            return 0;
+        }
+    }
+    return !ferror(from);
+}
+
+int copy_file(const char* from_file_name, FILE* to)
+{
+    FILE* from = fopen(from_file_name, "rb");
+    if (!from) {
+        return 0;
+    }
+    int ok = copy_stream(from, to);
+    fclose(from);
+    return ok;
+}
+
+/* Returns 1 and copies the cached result to write_file_name on a hit */
+int cache_lookup(const char* cache_dir, const char* key, const char* write_file_name)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.png", cache_dir, key);
+
+    /* Open the entry before touching the output: once open, it stays
+       readable even if a concurrent insert evicts it */
+    FILE* from = fopen(path, "rb");
+    if (!from) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        abort_("Cached result %s could not be opened for reading", path);
+    }
+
+    FILE* fp = fopen(write_file_name, "wb");
+    if (!fp) {
+        abort_("File %s could not be opened for writing", write_file_name);
+    }
+    if (!copy_stream(from, fp)) {
+        abort_("Error while copying cached result %s to %s", path, write_file_name);
+    }
+    fclose(from);
+    if (fclose(fp) != 0) {
+        abort_("Error while writing %s", write_file_name);
+    }
+
+    /* Mark as recently used */
+    utime(path, NULL);
+    return 1;
+}
+
+int is_entry_name(const char* name)
+{
+    return strlen(name) == CACHE_KEY_SIZE - 1 + 4 &&
+           strspn(name, "0123456789abcdef") == CACHE_KEY_SIZE - 1 &&
+           strcmp(name + CACHE_KEY_SIZE - 1, ".png") == 0;
+}
+
+int compare_entry_mtime(const void* a, const void* b)
+{
+    time_t mtime_a = ((const struct cache_entry*)a)->mtime;
+    time_t mtime_b = ((const struct cache_entry*)b)->mtime;
+    return (mtime_a > mtime_b) - (mtime_a < mtime_b);
+}
+
+struct cache_entry* list_entries(const char* cache_dir, int* count, uint64_t* total_bytes)
+{
+    DIR* dir = opendir(cache_dir);
+    if (!dir) {
+        return NULL;
+    }
+
+    int capacity = 64;
+    struct cache_entry* entries = (struct cache_entry*) malloc(sizeof(struct cache_entry) * capacity);
+    if (!entries) {
+        abort_("Failed to allocate memory to list cache entries");
+    }
+    *count = 0;
+    *total_bytes = 0;
+
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        char path[4096];
+        struct stat st;
+        if (!is_entry_name(dirent->d_name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, dirent->d_name);
+        if (stat(path, &st) != 0) {
+            /* Evicted concurrently */
+            continue;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            entries = (struct cache_entry*) realloc(entries, sizeof(struct cache_entry) * capacity);
+            if (!entries) {
+                abort_("Failed to allocate memory to list cache entries");
+            }
+        }
+        strcpy(entries[*count].name, dirent->d_name);
+        entries[*count].size = st.st_size;
+        entries[*count].mtime = st.st_mtime;
+        *total_bytes += st.st_size;
+        (*count)++;
+    }
+    closedir(dir);
+    return entries;
+}
+
+/* Returns 0 if the usage file is empty, as it is when just created */
+int read_usage(int fd, uint64_t* total_bytes)
+{
+    char buffer[32];
+    ssize_t length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    *total_bytes = strtoull(buffer, NULL, 10);
+    return 1;
+}
+
+void write_usage(int fd, uint64_t total_bytes)
+{
+    char buffer[32];
+    int length = snprintf(buffer, sizeof(buffer), "%llu\n", (unsigned long long)total_bytes);
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, buffer, length, 0) != length) {
+        warn_("Could not record cache size");
+    }
+}
+
+/* Lists the entries and, if they exceed max_bytes, evicts the least
+   recently used down to EVICT_TO_PERCENT of it. Returns the total size
+   of the entries left. */
+uint64_t evict_entries(const char* cache_dir, uint64_t max_bytes)
+{
+    char path[4096];
+    int i, count;
+    uint64_t total_bytes;
+    struct cache_entry* entries = list_entries(cache_dir, &count, &total_bytes);
+    if (!entries) {
+        return 0;
+    }
+    if (total_bytes > max_bytes) {
+        uint64_t target_bytes = max_bytes / 100 * EVICT_TO_PERCENT;
+        qsort(entries, count, sizeof(struct cache_entry), compare_entry_mtime);
+        for (i=0; i < count && total_bytes > target_bytes; i++) {
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, entries[i].name);
+            if (unlink(path) == 0) {
+                total_bytes -= entries[i].size;
+            }
+        }
+    }
+    free(entries);
+    return total_bytes;
+}
+
+/* Failures here are reported but not fatal, since the scaled output
+   has already been written. */
+void cache_insert(const char* cache_dir, const char* key, const char* write_file_name, uint64_t max_bytes)
+{
+    char temp_path[4096];
+    char path[4096];
+    struct stat st;
+
+    mkdir(cache_dir, 0777);
+    snprintf(temp_path, sizeof(temp_path), "%s/.%s.XXXXXX", cache_dir, key);
+    snprintf(path, sizeof(path), "%s/%s.png", cache_dir, key);
+
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        warn_("Could not create temporary file in cache directory %s", cache_dir);
+        return;
+    }
+    fchmod(fd, 0644);
+    FILE* fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+        unlink(temp_path);
+        warn_("Could not open temporary file %s", temp_path);
+        return;
+    }
+    int ok = copy_file(write_file_name, fp);
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        warn_("Could not add %s to cache directory %s", write_file_name, cache_dir);
+        return;
+    }
+
+    uint64_t entry_bytes = stat(path, &st) == 0 ? st.st_size : 0;
+
+    /* Evict least recently used entries if over the size bound */
+    snprintf(path, sizeof(path), "%s/" USAGE_FILE_NAME, cache_dir);
+    int usage_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (usage_fd < 0 || flock(usage_fd, LOCK_EX) != 0) {
+        warn_("Could not lock %s", path);
+        if (usage_fd >= 0) {
+            close(usage_fd);
+        }
+        return;
+    }
+    uint64_t total_bytes;
+    if (!read_usage(usage_fd, &total_bytes) || total_bytes + entry_bytes > max_bytes) {
+        total_bytes = evict_entries(cache_dir, max_bytes);
+    } else {
+        total_bytes += entry_bytes;
+    }
+    write_usage(usage_fd, total_bytes);
+    close(usage_fd);
+}
+
+void cache_print_stats(const char* cache_dir, uint64_t max_bytes)
+{
+    int i;
+    int count;
+    uint64_t total_bytes;
+    struct cache_entry* entries = list_entries(cache_dir, &count, &total_bytes);
+    if (!entries) {
+        abort_("Cache directory %s could not be opened", cache_dir);
+    }
+
+    time_t oldest = 0, newest = 0;
+    for (i=0; i < count; i++) {
+        if (i == 0 || entries[i].mtime < oldest) {
+            oldest = entries[i].mtime;
+        }
+        if (i == 0 || entries[i].mtime > newest) {
+            newest = entries[i].mtime;
+        }
+    }
+    printf("{\"entries\":%d,\"bytes\":%llu,\"max_bytes\":%llu,"
+           "\"oldest_entry_age\":%lld,\"newest_entry_age\":%lld}\n",
+           count, (unsigned long long)total_bytes, (unsigned long long)max_bytes,
+           count ? (long long)(time(NULL) - oldest) : 0LL,
+           count ? (long long)(time(NULL) - newest) : 0LL);
+    free(entries);
+}
@@ -0,0 +1,39 @@
+/* Copyright (c) 2011 Derrick Coetzee, Guillaume Cottenceau, and contributors
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Based on code distributed by Guillaume Cottenceau and contributors
+under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
+*/
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdint.h>
+
+/* 32 hex digits plus terminator */
+#define CACHE_KEY_SIZE 33
+
+void cache_make_key(const char* read_file_name, const char* params, char* key);
+int cache_lookup(const char* cache_dir, const char* key, const char* write_file_name);
+void cache_insert(const char* cache_dir, const char* key, const char* write_file_name, uint64_t max_bytes);
+void cache_print_stats(const char* cache_dir, uint64_t max_bytes);
+
+#endif /* #ifndef _CACHE_H_ */
@@ -0,0 +1,314 @@
+/* Copyright (c) 2011 Derrick Coetzee, Guillaume Cottenceau, and contributors
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Based on code distributed by Guillaume Cottenceau and contributors
+under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
+*/
+
+#include "compare.h"
+#include "png_utils.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <stdint.h> /* uint64_t */
+#include <string.h>
+#include <math.h>
+
+#include <png.h>
+
+#define ROUND_DIV(x,y) (((x) + (y)/2)/(y))
+
+/* SSIM is computed over windows of WINDOW_SIZE x WINDOW_SIZE samples of
+   each channel, placed every WINDOW_STEP pixels in each direction. Only
+   the last WINDOW_SIZE rows are kept, in a ring. */
+#define WINDOW_SIZE 8
+#define WINDOW_STEP 4
+#define SSIM_K1 0.01
+#define SSIM_K2 0.03
+
+/* Rows are widened to 16-bit samples, so the sums of squares of a window
+   need 64 bits */
+struct window_sums
+{
+    uint64_t* sum_1;
+    uint64_t* sum_2;
+    uint64_t* sum_sq_1;
+    uint64_t* sum_sq_2;
+    uint64_t* sum_12;
+};
+
+static int read_row_pair(struct png_info read_1, png_bytep row_1, struct png_info read_2, png_bytep row_2);
+static void discard_read_png(struct png_info info);
+static void widen_row(png_bytep row, uint16_t* out, int n, int bit_depth, unsigned int scale);
+static void premultiply_row(uint16_t* row, uint16_t* out, int width, int channels, unsigned int max_value);
+static void sum_columns(uint16_t** ring_1, uint16_t** ring_2, int ring_rows, int n, struct window_sums sums);
+static double ssim_of_window_row(struct window_sums sums, int width, int channels,
+                                 int window_width, int window_height, double max_value, int* count);
+
+/* Copies a row of either bit depth to 16-bit samples, multiplying 8-bit
+   samples by scale (1, or 257 when compared against a 16-bit image) */
+void widen_row(png_bytep row, uint16_t* out, int n, int bit_depth, unsigned int scale)
+{
+    int i;
+    if (bit_depth == 16) {
+        memcpy(out, row, sizeof(uint16_t) * n);
+        return;
+    }
+    for (i=0; i < n; i++) {
+        out[i] = row[i] * scale;
+    }
+}
+
+/* Color channels are weighted by alpha, so that the values under fully
+   transparent pixels, which pngscale leaves arbitrary, don't count */
+void premultiply_row(uint16_t* row, uint16_t* out, int width, int channels, unsigned int max_value)
+{
+    int x, c;
+    if (channels != 2 && channels != 4) {
+        memcpy(out, row, sizeof(uint16_t) * width * channels);
+        return;
+    }
+    for (x=0; x < width; x++) {
+        uint16_t* ptr = &(row[x*channels]);
+        uint32_t alpha = ptr[channels - 1];
+        for (c=0; c < channels - 1; c++) {
+            out[x*channels + c] = ROUND_DIV(ptr[c] * alpha, max_value);
+        }
+        out[x*channels + channels - 1] = alpha;
+    }
+}
+
+/* Per-sample sums down the rows of the ring. Kept as simple loops over
+   contiguous arrays so the compiler vectorizes them. */
+void sum_columns(uint16_t** ring_1, uint16_t** ring_2, int ring_rows, int n, struct window_sums sums)
+{
+    int i, j;
+    memset(sums.sum_1, 0, sizeof(uint64_t) * n);
+    memset(sums.sum_2, 0, sizeof(uint64_t) * n);
+    memset(sums.sum_sq_1, 0, sizeof(uint64_t) * n);
+    memset(sums.sum_sq_2, 0, sizeof(uint64_t) * n);
+    memset(sums.sum_12, 0, sizeof(uint64_t) * n);
+    for (j=0; j < ring_rows; j++) {
+        const uint16_t* restrict row_1 = ring_1[j];
+        const uint16_t* restrict row_2 = ring_2[j];
+        uint64_t* restrict sum_1 = sums.sum_1;
+        uint64_t* restrict sum_2 = sums.sum_2;
+        uint64_t* restrict sum_sq_1 = sums.sum_sq_1;
+        uint64_t* restrict sum_sq_2 = sums.sum_sq_2;
+        uint64_t* restrict sum_12 = sums.sum_12;
+        for (i=0; i < n; i++) {
+            uint64_t a = row_1[i];
+            uint64_t b = row_2[i];
+            sum_1[i] += a;
+            sum_2[i] += b;
+            sum_sq_1[i] += a * a;
+            sum_sq_2[i] += b * b;
+            sum_12[i] += a * b;
+        }
+    }
+}
+
+/* Adds up the SSIM of each window whose rows are summed in sums, and
+   the number of windows to *count */
+double ssim_of_window_row(struct window_sums sums, int width, int channels,
+                          int window_width, int window_height, double max_value, int* count)
+{
+    int x0, k, c;
+    double n = (double)window_width * window_height;
+    double c1 = SSIM_K1 * max_value * SSIM_K1 * max_value;
+    double c2 = SSIM_K2 * max_value * SSIM_K2 * max_value;
+    double result = 0.0;
+    for (x0=0; x0 + window_width <= width; x0 += WINDOW_STEP) {
+        for (c=0; c < channels; c++) {
+            uint64_t s1 = 0, s2 = 0, ss1 = 0, ss2 = 0, s12 = 0;
+            for (k=0; k < window_width; k++) {
+                int i = (x0 + k)*channels + c;
+                s1 += sums.sum_1[i];
+                s2 += sums.sum_2[i];
+                ss1 += sums.sum_sq_1[i];
+                ss2 += sums.sum_sq_2[i];
+                s12 += sums.sum_12[i];
+            }
+            double mean_1 = s1 / n;
+            double mean_2 = s2 / n;
+            double variance_1 = ss1 / n - mean_1 * mean_1;
+            double variance_2 = ss2 / n - mean_2 * mean_2;
+            double covariance = s12 / n - mean_1 * mean_2;
+            result += ((2 * mean_1 * mean_2 + c1) * (2 * covariance + c2)) /
+                      ((mean_1 * mean_1 + mean_2 * mean_2 + c1) * (variance_1 + variance_2 + c2));
+            (*count)++;
+        }
+    }
+    return result;
+}
+
+/* Computes every metric in a single pass over both images, reading them
+   a row at a time. With keep_16, 16-bit images are compared at their full
+   precision (an 8-bit image compared against one is widened to 16 bits),
+   but every metric is still reported in units of 8-bit samples. Returns
+   NULL on success or a description of why the images can't be compared. */
+const char* compare_png(const char* filename_1, const char* filename_2, int keep_16, struct compare_result* result)
+{
+    int x, y, c;
+
+    /* Nothing here may abort on a bad file, so that one bad pair doesn't
+       take down a whole batch */
+    struct png_info read_1, read_2;
+    const char* error = try_open_read_png(filename_1, keep_16, &read_1);
+    if (error) {
+        return error;
+    }
+    error = try_open_read_png(filename_2, keep_16, &read_2);
+    if (error) {
+        discard_read_png(read_1);
+        return error;
+    }
+    int channels = read_1.channels;
+    if (read_1.width != read_2.width ||
+        read_1.height != read_2.height ||
+        read_1.channels != read_2.channels)
+    {
+        /* Don't attempt to compare images of different sizes or color types */
+        discard_read_png(read_1);
+        discard_read_png(read_2);
+        return "images differ in size or color type";
+    }
+    int width = read_1.width;
+    int height = read_1.height;
+    int n = width * channels;
+    int window_width = width < WINDOW_SIZE ? width : WINDOW_SIZE;
+    int window_height = height < WINDOW_SIZE ? height : WINDOW_SIZE;
+    unsigned int max_value = read_1.bit_depth == 16 || read_2.bit_depth == 16 ? 65535 : 255;
+    double scale = max_value / 255.0;
+
+    png_bytep read_row_pointer_1 = (png_byte*) malloc(read_1.rowbytes);
+    png_bytep read_row_pointer_2 = (png_byte*) malloc(read_2.rowbytes);
+    uint16_t* wide_row_1 = (uint16_t*) malloc(sizeof(uint16_t) * n);
+    uint16_t* wide_row_2 = (uint16_t*) malloc(sizeof(uint16_t) * n);
+    uint16_t* ring_1[WINDOW_SIZE];
+    uint16_t* ring_2[WINDOW_SIZE];
+    struct window_sums sums;
+    sums.sum_1 = (uint64_t*) malloc(sizeof(uint64_t) * n);
+    sums.sum_2 = (uint64_t*) malloc(sizeof(uint64_t) * n);
+    sums.sum_sq_1 = (uint64_t*) malloc(sizeof(uint64_t) * n);
+    sums.sum_sq_2 = (uint64_t*) malloc(sizeof(uint64_t) * n);
+    sums.sum_12 = (uint64_t*) malloc(sizeof(uint64_t) * n);
+    if (!read_row_pointer_1 || !read_row_pointer_2 || !wide_row_1 || !wide_row_2 ||
+        !sums.sum_1 || !sums.sum_2 || !sums.sum_sq_1 || !sums.sum_sq_2 || !sums.sum_12) {
+        abort_("Failed to allocate memory to compare %s and %s", filename_1, filename_2);
+    }
+    for (y=0; y < window_height; y++) {
+        ring_1[y] = (uint16_t*) malloc(sizeof(uint16_t) * n);
+        ring_2[y] = (uint16_t*) malloc(sizeof(uint16_t) * n);
+        if (!ring_1[y] || !ring_2[y]) {
+            abort_("Failed to allocate memory to compare %s and %s", filename_1, filename_2);
+        }
+    }
+
+    uint64_t squared_difference = 0;
+    uint64_t premultiplied_squared_difference = 0;
+    double ssim_total = 0.0;
+    int ssim_count = 0;
+    for (y=0; y < height; y++) {
+        if (!read_row_pair(read_1, read_row_pointer_1, read_2, read_row_pointer_2)) {
+            error = "image data is corrupt or truncated";
+            break;
+        }
+        widen_row(read_row_pointer_1, wide_row_1, n, read_1.bit_depth, max_value / 255);
+        widen_row(read_row_pointer_2, wide_row_2, n, read_2.bit_depth, max_value / 255);
+        for (x=0; x < width; x++) {
+            uint16_t* read_ptr_1 = &(wide_row_1[x*channels]);
+            uint16_t* read_ptr_2 = &(wide_row_2[x*channels]);
+            if (channels == 4 && (read_ptr_1[3] == 0 || read_ptr_2[3] == 0)) {
+                /* If one of them is fully transparent, assume RGB channels match */
+                int64_t diff = read_ptr_1[3] - read_ptr_2[3];
+                squared_difference += diff*diff;
+            } else {
+                for (c=0; c < channels; c++) {
+                    int64_t diff = read_ptr_1[c] - read_ptr_2[c];
+                    squared_difference += diff*diff;
+                }
+            }
+        }
+
+        uint16_t* row_1 = ring_1[y % window_height];
+        uint16_t* row_2 = ring_2[y % window_height];
+        premultiply_row(wide_row_1, row_1, width, channels, max_value);
+        premultiply_row(wide_row_2, row_2, width, channels, max_value);
+        for (x=0; x < n; x++) {
+            int64_t diff = row_1[x] - row_2[x];
+            premultiplied_squared_difference += diff*diff;
+        }
+
+        int window_top = y + 1 - window_height;
+        if (window_top >= 0 && window_top % WINDOW_STEP == 0) {
+            sum_columns(ring_1, ring_2, window_height, n, sums);
+            ssim_total += ssim_of_window_row(sums, width, channels, window_width, window_height,
+                                             max_value, &ssim_count);
+        }
+    }
+
+    if (!error) {
+        result->distance = sqrt((double)squared_difference)/scale/sqrt((double)width*width + (double)height*height);
+        result->mse = (double)premultiplied_squared_difference / ((double)n * height) / (scale * scale);
+        result->psnr = result->mse == 0 ? INFINITY : 10 * log10(255.0 * 255.0 / result->mse);
+        result->ssim = ssim_total / ssim_count;
+    }
+
+    for (y=0; y < window_height; y++) {
+        free(ring_1[y]);
+        free(ring_2[y]);
+    }
+    free(sums.sum_1);
+    free(sums.sum_2);
+    free(sums.sum_sq_1);
+    free(sums.sum_sq_2);
+    free(sums.sum_12);
+    free(read_row_pointer_1);
+    free(read_row_pointer_2);
+    free(wide_row_1);
+    free(wide_row_2);
+    /* Only the image data is compared, so the chunks after it are not read */
+    discard_read_png(read_1);
+    discard_read_png(read_2);
+    return error;
+}
+
+/* Reads the next row of each image. Returns 0 if libpng finds the image
+   data of either one corrupt or truncated. */
+int read_row_pair(struct png_info read_1, png_bytep row_1, struct png_info read_2, png_bytep row_2)
+{
+    if (setjmp(png_jmpbuf(read_1.png_ptr))) {
+        return 0;
+    }
+    if (setjmp(png_jmpbuf(read_2.png_ptr))) {
+        return 0;
+    }
+    read_png_row(read_1, row_1);
+    read_png_row(read_2, row_2);
+    return 1;
+}
+
+void discard_read_png(struct png_info info)
+{
+    png_destroy_read_struct(&info.png_ptr, &info.info_ptr, NULL);
+    fclose(info.fp);
+}
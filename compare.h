@@ -0,0 +1,39 @@
+/* Copyright (c) 2011 Derrick Coetzee, Guillaume Cottenceau, and contributors
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Based on code distributed by Guillaume Cottenceau and contributors
+under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
+*/
+
+#ifndef _COMPARE_H_
+#define _COMPARE_H_
+
+struct compare_result
+{
+    double distance; /* root of summed squared differences over the image diagonal */
+    double mse;      /* mean squared difference per sample in 8-bit units, alpha premultiplied */
+    double psnr;     /* in dB, INFINITY if the images are identical */
+    double ssim;     /* mean SSIM over 8x8 windows, alpha premultiplied */
+};
+
+const char* compare_png(const char* filename_1, const char* filename_2, int keep_16, struct compare_result* result);
+
+#endif /* #ifndef _COMPARE_H_ */
@@ -26,62 +26,517 @@ under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
 #include "png_utils.h"
 #include "utils.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Compressed bytes handed to png_process_data at a time. inflate expands
+   data at most about 1032 times, so this also bounds how many decoded
+   rows can pile up in the row queue. */
+#define PROGRESSIVE_CHUNK_SIZE 4096
+#define TAIL_POLL_MICROSECONDS 50000
+
+/* State of a file being read with libpng's progressive (push) reader.
+   Rows delivered by the row callback wait in a FIFO until the scaler
+   asks for them with read_png_row. */
+struct progressive_state
+{
+    const char* file_name;
+    int fd;
+    int growing;                /* regular file that may still be appended to */
+    int timeout_seconds;
+    const char* done_file_name; /* once this exists, end of file is final */
+    int keep_16;
+    double last_data_time;      /* from monotonic_seconds */
+    int have_info;
+    int rowbytes;
+    png_bytep rows;
+    int row_capacity;
+    int row_head;
+    int row_count;
+    png_byte buffer[PROGRESSIVE_CHUNK_SIZE];
+};
+
+static int host_is_little_endian(void);
+static void set_read_transforms(png_structp png_ptr, int keep_16);
+static double monotonic_seconds(void);
+static size_t tail_read(struct progressive_state* state, png_bytep buffer, size_t size);
+static void feed_progressive(struct png_info* info);
+static void progressive_info_callback(png_structp png_ptr, png_infop info_ptr);
+static void progressive_row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass);
+
 struct png_info open_read_png(const char* file_name)
+{
+    return open_read_png_depth(file_name, 0);
+}
+
+/* Little-endian hosts need 16-bit samples byte-swapped from PNG order */
+int host_is_little_endian(void)
+{
+    const uint16_t one = 1;
+    return *(const png_byte*)&one == 1;
+}
+
+/* Expands grayscale, RGB, or palette images to RGBA and either reduces
+   16-bit samples to 8 bits or, with keep_16, leaves them as native
+   uint16_t values */
+void set_read_transforms(png_structp png_ptr, int keep_16)
+{
+    png_set_expand(png_ptr);
+    if (!keep_16) {
+        png_set_strip_16(png_ptr);
+    } else if (host_is_little_endian()) {
+        png_set_swap(png_ptr);
+    }
+}
+
+/* As open_read_png, but with keep_16 rows of 16-bit images hold native
+   uint16_t samples */
+struct png_info open_read_png_depth(const char* file_name, int keep_16)
 {
     struct png_info result;
+    const char* error = try_open_read_png(file_name, keep_16, &result);
+    if (error) {
+        abort_("File %s: %s", file_name, error);
+    }
+
+    /* read file */
+    if (setjmp(png_jmpbuf(result.png_ptr))) {
+        abort_("Error while reading PNG image");
+    }
+
+    return result;
+}
+
+/* As open_read_png_depth, but returns a description of the problem
+   instead of aborting if the file can't be opened or its header chunks
+   can't be read, or NULL on success. libpng errors in the rows read
+   afterwards longjmp to png_jmpbuf(result->png_ptr), which the caller
+   must set. */
+const char* try_open_read_png(const char* file_name, int keep_16, struct png_info* result)
+{
     unsigned char header[8];    /* 8 is the maximum size that can be checked */
 
     /* open file and test for it being a png */
-    result.fp = fopen(file_name, "rb");
-    if (!result.fp) {
-        abort_("File %s could not be opened for reading", file_name);
+    result->fp = fopen(file_name, "rb");
+    if (!result->fp) {
+        return "could not be opened for reading";
     }
-    if (fread(header, 1, 8, result.fp) < 8 || png_sig_cmp(header, 0, 8)) {
-        abort_("File %s is not recognized as a PNG file", file_name);
+    if (fread(header, 1, 8, result->fp) < 8 || png_sig_cmp(header, 0, 8)) {
+        fclose(result->fp);
+        return "not recognized as a PNG file";
     }
 
+    result->progressive = NULL;
+
     /* initialize stuff */
-    result.png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!result.png_ptr) {
-        abort_("png_create_read_struct failed while opening %s for reading", file_name);
+    result->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!result->png_ptr) {
+        fclose(result->fp);
+        return "png_create_read_struct failed";
     }
 
-    result.info_ptr = png_create_info_struct(result.png_ptr);
-    if (!result.info_ptr) {
-        abort_("png_create_info_struct failed while opening %s for reading", file_name);
+    result->info_ptr = png_create_info_struct(result->png_ptr);
+    if (!result->info_ptr) {
+        png_destroy_read_struct(&result->png_ptr, NULL, NULL);
+        fclose(result->fp);
+        return "png_create_info_struct failed";
     }
 
-    if (setjmp(png_jmpbuf(result.png_ptr))) {
-        abort_("Error during init_io while opening %s for reading", file_name);
+    if (setjmp(png_jmpbuf(result->png_ptr))) {
+        png_destroy_read_struct(&result->png_ptr, &result->info_ptr, NULL);
+        fclose(result->fp);
+        return "corrupt or unsupported header chunks";
     }
 
-    png_init_io(result.png_ptr, result.fp);
-    png_set_sig_bytes(result.png_ptr, 8);
+    png_init_io(result->png_ptr, result->fp);
+    png_set_sig_bytes(result->png_ptr, 8);
+
+    png_read_info(result->png_ptr, result->info_ptr);
+
+    set_read_transforms(result->png_ptr, keep_16);
+
+    /* Must be before reading fields from result->info_ptr */
+    png_read_update_info(result->png_ptr, result->info_ptr);
+
+    result->width = png_get_image_width(result->png_ptr, result->info_ptr);
+    result->height = png_get_image_height(result->png_ptr, result->info_ptr);
+    result->color_type = png_get_color_type(result->png_ptr, result->info_ptr);
+    result->bit_depth = png_get_bit_depth(result->png_ptr, result->info_ptr);
+    result->number_of_passes = png_set_interlace_handling(result->png_ptr);
+    result->rowbytes = png_get_rowbytes(result->png_ptr, result->info_ptr);
+    result->channels = png_get_channels(result->png_ptr, result->info_ptr);
+
+    return NULL;
+}
+
+/* Unaffected by changes to the wall clock, and finer than time() so a
+   short --tail-timeout doesn't fire up to a second early */
+double monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Reads up to size bytes, waiting for more to be appended to a regular
+   file that is still being written. Returns 0 only at the real end of
+   the input: end of a pipe, or end of a file once done_file_name exists.
+   Aborts if no data arrives for timeout_seconds. */
+size_t tail_read(struct progressive_state* state, png_bytep buffer, size_t size)
+{
+    for (;;) {
+        ssize_t bytes_read = read(state->fd, buffer, size);
+        if (bytes_read > 0) {
+            state->last_data_time = monotonic_seconds();
+            return bytes_read;
+        }
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            abort_("Error while reading %s", state->file_name);
+        }
+        if (!state->growing) {
+            return 0;
+        }
+        if (state->done_file_name && access(state->done_file_name, F_OK) == 0) {
+            /* Writer is finished; anything it wrote before signalling is
+               readable now */
+            state->growing = 0;
+            continue;
+        }
+        if (monotonic_seconds() - state->last_data_time >= state->timeout_seconds) {
+            abort_("No new data in %s for %d seconds", state->file_name, state->timeout_seconds);
+        }
+        usleep(TAIL_POLL_MICROSECONDS);
+    }
+}
+
+void progressive_info_callback(png_structp png_ptr, png_infop info_ptr)
+{
+    struct progressive_state* state = (struct progressive_state*) png_get_progressive_ptr(png_ptr);
 
-    png_read_info(result.png_ptr, result.info_ptr);
+    if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+        abort_("Interlaced images can't be read progressively: %s", state->file_name);
+    }
 
-    /* Expand any grayscale, RGB, or palette images to RGBA */
-    png_set_expand(result.png_ptr);
+    set_read_transforms(png_ptr, state->keep_16);
+    png_read_update_info(png_ptr, info_ptr);
 
-    /* Reduce any 16-bits-per-sample images to 8-bits-per-sample */
-    png_set_strip_16(result.png_ptr);
+    state->rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    state->have_info = 1;
+}
 
-    /* Must be before reading fields from result.info_ptr */
-    png_read_update_info(result.png_ptr, result.info_ptr);
+void progressive_row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass)
+{
+    struct progressive_state* state = (struct progressive_state*) png_get_progressive_ptr(png_ptr);
+    /* Interlaced input is refused, so rows arrive once each and in order */
+    (void)row_num;
+    (void)pass;
+
+    if (state->row_head + state->row_count == state->row_capacity) {
+        if (state->row_head > 0) {
+            memmove(state->rows, state->rows + (size_t)state->row_head * state->rowbytes,
+                    (size_t)state->row_count * state->rowbytes);
+            state->row_head = 0;
+        } else {
+            state->row_capacity = state->row_capacity ? 2 * state->row_capacity : 4;
+            state->rows = (png_bytep) realloc(state->rows, (size_t)state->row_capacity * state->rowbytes);
+            if (!state->rows) {
+                abort_("Failed to allocate memory to queue rows of %s", state->file_name);
+            }
+        }
+    }
+    memcpy(state->rows + (size_t)(state->row_head + state->row_count) * state->rowbytes,
+           new_row, state->rowbytes);
+    state->row_count++;
+}
+
+/* Hands the next chunk of input to libpng, which calls back with any
+   header information and rows it completes */
+void feed_progressive(struct png_info* info)
+{
+    struct progressive_state* state = info->progressive;
+    size_t bytes_read = tail_read(state, state->buffer, sizeof(state->buffer));
+    if (bytes_read == 0) {
+        abort_("File %s ended before the image was complete", state->file_name);
+    }
+    if (setjmp(png_jmpbuf(info->png_ptr))) {
+        abort_("Error while reading PNG image");
+    }
+    png_process_data(info->png_ptr, info->info_ptr, state->buffer, bytes_read);
+}
+
+/* Like open_read_png, but decodes with libpng's progressive reader,
+   fed as bytes arrive. The file may still be growing, or be a pipe ("-"
+   for standard input). */
+struct png_info open_read_png_progressive(const char* file_name, int timeout_seconds,
+                                          const char* done_file_name, int keep_16)
+{
+    struct png_info result;
+    struct stat st;
+
+    memset(&result, 0, sizeof(result));
+    struct progressive_state* state = (struct progressive_state*) calloc(1, sizeof(struct progressive_state));
+    if (!state) {
+        abort_("Failed to allocate memory while opening %s for reading", file_name);
+    }
+    result.progressive = state;
+    state->file_name = file_name;
+    state->timeout_seconds = timeout_seconds;
+    state->done_file_name = done_file_name;
+    state->keep_16 = keep_16;
+    state->last_data_time = monotonic_seconds();
+    state->fd = strcmp(file_name, "-") == 0 ? STDIN_FILENO : open(file_name, O_RDONLY);
+    if (state->fd < 0) {
+        abort_("File %s could not be opened for reading", file_name);
+    }
+    state->growing = fstat(state->fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    result.png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!result.png_ptr) {
+        abort_("png_create_read_struct failed while opening %s for reading", file_name);
+    }
+    result.info_ptr = png_create_info_struct(result.png_ptr);
+    if (!result.info_ptr) {
+        abort_("png_create_info_struct failed while opening %s for reading", file_name);
+    }
+    png_set_progressive_read_fn(result.png_ptr, state, progressive_info_callback,
+                                progressive_row_callback, NULL);
+#ifdef PNG_eXIf_SUPPORTED
+    /* libpng's progressive reader has no eXIf handler; keep the chunk as
+       an unknown one so get_exif_orientation can still find it */
+    png_set_keep_unknown_chunks(result.png_ptr, PNG_HANDLE_CHUNK_ALWAYS, (png_const_bytep) "eXIf", 1);
+#endif
+
+    while (!state->have_info) {
+        feed_progressive(&result);
+    }
 
     result.width = png_get_image_width(result.png_ptr, result.info_ptr);
     result.height = png_get_image_height(result.png_ptr, result.info_ptr);
     result.color_type = png_get_color_type(result.png_ptr, result.info_ptr);
     result.bit_depth = png_get_bit_depth(result.png_ptr, result.info_ptr);
-    result.number_of_passes = png_set_interlace_handling(result.png_ptr);
+    result.number_of_passes = 1;
     result.rowbytes = png_get_rowbytes(result.png_ptr, result.info_ptr);
     result.channels = png_get_channels(result.png_ptr, result.info_ptr);
+    return result;
+}
 
-    /* read file */
-    if (setjmp(png_jmpbuf(result.png_ptr))) {
-        abort_("Error while reading PNG image");
+/* Reads the next row of the image, from whichever reader opened it */
+void read_png_row(struct png_info info, png_bytep row)
+{
+    struct progressive_state* state = info.progressive;
+    if (!state) {
+        png_read_row(info.png_ptr, row, NULL);
+        return;
+    }
+    while (state->row_count == 0) {
+        feed_progressive(&info);
+    }
+    memcpy(row, state->rows + (size_t)state->row_head * state->rowbytes, state->rowbytes);
+    state->row_head++;
+    state->row_count--;
+    if (state->row_count == 0) {
+        state->row_head = 0;
+    }
+}
+
+static png_uint_32 get_uint_32(const png_byte* buf)
+{
+    return ((png_uint_32)buf[0] << 24) | ((png_uint_32)buf[1] << 16) |
+           ((png_uint_32)buf[2] << 8) | (png_uint_32)buf[3];
+}
+
+/* An unsigned value of 2 or 4 bytes from TIFF data of either byte order */
+static png_uint_32 get_tiff_uint(const png_byte* buf, int size, int big_endian)
+{
+    png_uint_32 result = 0;
+    int i;
+    for (i=0; i < size; i++) {
+        result |= (png_uint_32)buf[big_endian ? i : size - 1 - i] << (8 * (size - 1 - i));
     }
+    return result;
+}
+
+/* The orientation (1-8) recorded in EXIF data, or 1 if there is none or
+   it can't be parsed */
+static int parse_exif_orientation(const png_byte* exif, png_uint_32 length)
+{
+    png_uint_32 ifd, entries, i;
+
+    if (!exif || length < 8) {
+        return 1;
+    }
+    if (memcmp(exif, "II*\0", 4) != 0 && memcmp(exif, "MM\0*", 4) != 0) {
+        return 1;
+    }
+    int big_endian = exif[0] == 'M';
+
+    /* Scan the entries of the first IFD for the Orientation tag, a SHORT */
+    ifd = get_tiff_uint(exif + 4, 4, big_endian);
+    if (ifd < 8 || ifd > length - 2) {
+        return 1;
+    }
+    entries = get_tiff_uint(exif + ifd, 2, big_endian);
+    for (i=0; i < entries && ifd + 2 + 12 * (i + 1) <= length; i++) {
+        const png_byte* entry = exif + ifd + 2 + 12 * i;
+        if (get_tiff_uint(entry, 2, big_endian) == 0x0112 && get_tiff_uint(entry + 2, 2, big_endian) == 3) {
+            png_uint_32 orientation = get_tiff_uint(entry + 8, 2, big_endian);
+            return orientation >= 1 && orientation <= 8 ? orientation : 1;
+        }
+    }
+    return 1;
+}
+
+/* The EXIF orientation (1-8) recorded in the image's eXIf chunk, or 1 if
+   there is none or it can't be parsed. Only an eXIf chunk ahead of the
+   image data is seen, since rows are consumed as they are decoded. */
+int get_exif_orientation(struct png_info info)
+{
+#ifdef PNG_eXIf_SUPPORTED
+    png_uint_32 length = 0;
+    png_bytep exif = NULL;
+
+    if (!png_get_eXIf_1(info.png_ptr, info.info_ptr, &length, &exif)) {
+        png_unknown_chunkp unknowns;
+        int count = png_get_unknown_chunks(info.png_ptr, info.info_ptr, &unknowns);
+        int chunk;
+        for (chunk=0; chunk < count; chunk++) {
+            if (memcmp(unknowns[chunk].name, "eXIf", 4) == 0) {
+                exif = unknowns[chunk].data;
+                length = unknowns[chunk].size;
+            }
+        }
+    }
+    return parse_exif_orientation(exif, length);
+#else
+    return 1;
+#endif
+}
 
+/* Reads the signature and the chunks before the first IDAT, keeping the
+   ones that determine what open_read_png would produce. Unlike
+   open_read_png this never creates a libpng read struct, so it's cheap
+   enough to run on every incoming file. Returns NULL on success or a
+   description of the problem. */
+const char* probe_png(const char* file_name, struct png_probe* probe)
+{
+    png_byte buf[16];
+    int seen_ihdr = 0;
+    int seen_exif = 0;
+
+    memset(probe, 0, sizeof(*probe));
+    probe->exif_orientation = 1;
+    FILE* fp = fopen(file_name, "rb");
+    if (!fp) {
+        return "could not be opened for reading";
+    }
+    if (fread(buf, 1, 8, fp) < 8 || png_sig_cmp(buf, 0, 8)) {
+        fclose(fp);
+        return "not recognized as a PNG file";
+    }
+
+    for (;;) {
+        if (fread(buf, 1, 8, fp) < 8) {
+            fclose(fp);
+            return "truncated before image data";
+        }
+        png_uint_32 length = get_uint_32(buf);
+        if (length > 0x7fffffff) {
+            /* The PNG specification limits chunk lengths to 2^31 - 1 */
+            fclose(fp);
+            return "invalid chunk length";
+        }
+        png_uint_32 skip = length + 4; /* chunk data and CRC */
+        if (!seen_ihdr && memcmp(buf + 4, "IHDR", 4) != 0) {
+            fclose(fp);
+            return "first chunk is not IHDR";
+        }
+
+        if (memcmp(buf + 4, "IHDR", 4) == 0) {
+            if (length != 13 || fread(buf, 1, 13, fp) < 13) {
+                fclose(fp);
+                return "invalid IHDR chunk";
+            }
+            probe->width = get_uint_32(buf);
+            probe->height = get_uint_32(buf + 4);
+            probe->bit_depth = buf[8];
+            probe->color_type = buf[9];
+            probe->interlace_type = buf[12];
+            if (probe->width <= 0 || probe->height <= 0) {
+                fclose(fp);
+                return "invalid image dimensions";
+            }
+            seen_ihdr = 1;
+            skip = 4;
+        } else if (memcmp(buf + 4, "PLTE", 4) == 0) {
+            probe->palette_entries = length / 3;
+        } else if (memcmp(buf + 4, "tRNS", 4) == 0) {
+            probe->has_trns = 1;
+        } else if (memcmp(buf + 4, "gAMA", 4) == 0 && length == 4) {
+            if (fread(buf, 1, 4, fp) < 4) {
+                fclose(fp);
+                return "invalid gAMA chunk";
+            }
+            probe->has_gama = 1;
+            probe->gama = get_uint_32(buf);
+            skip = 4;
+#ifdef PNG_eXIf_SUPPORTED
+        } else if (memcmp(buf + 4, "eXIf", 4) == 0 && !seen_exif) {
+            png_bytep exif = (png_bytep) malloc(length ? length : 1);
+            if (!exif || fread(exif, 1, length, fp) < length) {
+                free(exif);
+                fclose(fp);
+                return "invalid eXIf chunk";
+            }
+            probe->exif_orientation = parse_exif_orientation(exif, length);
+            free(exif);
+            seen_exif = 1;
+            skip = 4;
+#endif
+        } else if (memcmp(buf + 4, "IDAT", 4) == 0 || memcmp(buf + 4, "IEND", 4) == 0) {
+            break;
+        }
+
+        if (fseek(fp, skip, SEEK_CUR) != 0) {
+            fclose(fp);
+            return "truncated before image data";
+        }
+    }
+
+    fclose(fp);
+    return NULL;
+}
+
+/* The png_info open_read_png_depth would return for a probed file, after
+   expansion of palettes, low bit depths and tRNS, and reduction of 16-bit
+   samples unless keep_16 is set */
+struct png_info probe_read_info(struct png_probe probe, int keep_16)
+{
+    struct png_info result;
+
+    memset(&result, 0, sizeof(result));
+    result.width = probe.width;
+    result.height = probe.height;
+    result.bit_depth = keep_16 && probe.bit_depth == 16 ? 16 : 8;
+    result.color_type = probe.color_type;
+    if (result.color_type == PNG_COLOR_TYPE_PALETTE) {
+        result.color_type = PNG_COLOR_TYPE_RGB;
+    }
+    if (probe.has_trns) {
+        result.color_type |= PNG_COLOR_MASK_ALPHA;
+    }
+    result.channels = get_channels_per_pixel(result);
+    result.rowbytes = result.width * result.channels * (result.bit_depth / 8);
+    result.number_of_passes = probe.interlace_type == PNG_INTERLACE_ADAM7 ? 7 : 1;
     return result;
 }
 
@@ -120,10 +575,14 @@ void open_write_png(const char* file_name, struct png_info* info)
                  info->bit_depth, info->color_type, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
-    png_read_update_info(info->png_ptr, info->info_ptr);
+    /* png_set_IHDR fills in rowbytes and channels; libpng 1.6 no longer
+       tolerates png_read_update_info on a write struct */
     info->rowbytes = png_get_rowbytes(info->png_ptr, info->info_ptr);
     info->channels = png_get_channels(info->png_ptr, info->info_ptr);
     png_write_info(info->png_ptr, info->info_ptr);
+    if (info->bit_depth == 16 && host_is_little_endian()) {
+        png_set_swap(info->png_ptr);
+    }
 
     /* set jmpbuf */
     if (setjmp(png_jmpbuf(info->png_ptr))) {
@@ -146,6 +605,16 @@ int get_channels_per_pixel(struct png_info info)
 }
 
 void close_read_png(struct png_info info) {
+    if (info.progressive) {
+        /* Everything needed has been decoded; don't wait for the rest */
+        png_destroy_read_struct(&info.png_ptr, &info.info_ptr, NULL);
+        if (info.progressive->fd != STDIN_FILENO) {
+            close(info.progressive->fd);
+        }
+        free(info.progressive->rows);
+        free(info.progressive);
+        return;
+    }
     if (setjmp(png_jmpbuf(info.png_ptr))) {
         abort_("Error during png_read_end");
     }
@@ -28,6 +28,8 @@ under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
 
 #include <png.h>
 
+struct progressive_state;
+
 struct png_info
 {
     png_structp png_ptr;
@@ -40,9 +42,33 @@ struct png_info
     int number_of_passes;
     int rowbytes;
     int channels;
+    struct progressive_state* progressive; /* NULL unless opened with open_read_png_progressive */
+};
+
+/* Header fields gathered by probe_png without decoding any image data */
+struct png_probe
+{
+    int width;
+    int height;
+    png_byte bit_depth;
+    png_byte color_type;
+    png_byte interlace_type;
+    int palette_entries; /* 0 if there is no PLTE chunk */
+    int has_trns;
+    int has_gama;
+    png_uint_32 gama; /* gAMA value, gamma times 100000 */
+    int exif_orientation; /* from an eXIf chunk ahead of the image data, 1 if none */
 };
 
 struct png_info open_read_png(const char* read_file_name);
+struct png_info open_read_png_depth(const char* read_file_name, int keep_16);
+const char* try_open_read_png(const char* read_file_name, int keep_16, struct png_info* result);
+struct png_info open_read_png_progressive(const char* read_file_name, int timeout_seconds,
+                                          const char* done_file_name, int keep_16);
+void read_png_row(struct png_info info, png_bytep row);
+int get_exif_orientation(struct png_info info);
+const char* probe_png(const char* read_file_name, struct png_probe* probe);
+struct png_info probe_read_info(struct png_probe probe, int keep_16);
 void open_write_png(const char* write_file_name, struct png_info* info);
 void close_read_png(struct png_info info);
 void close_write_png(struct png_info info);
@@ -0,0 +1,194 @@
+/* Copyright (c) 2011 Derrick Coetzee, Guillaume Cottenceau, and contributors
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Based on code distributed by Guillaume Cottenceau and contributors
+under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
+*/
+
+#include "compare.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+
+struct comparison
+{
+    const char* filename_1;
+    const char* filename_2;
+    const char* error;
+    struct compare_result result;
+};
+
+struct work_queue
+{
+    pthread_mutex_t mutex;
+    struct comparison* comparisons;
+    int count;
+    int next;
+    int keep_16;
+};
+
+static void* compare_worker(void* arg);
+static void usage(void);
+int main(int argc, char **argv);
+
+void* compare_worker(void* arg)
+{
+    struct work_queue* queue = (struct work_queue*) arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->mutex);
+        int i = queue->next++;
+        pthread_mutex_unlock(&queue->mutex);
+        if (i >= queue->count) {
+            return NULL;
+        }
+        struct comparison* comparison = &(queue->comparisons[i]);
+        comparison->error = compare_png(comparison->filename_1, comparison->filename_2, queue->keep_16,
+                                        &comparison->result);
+    }
+}
+
+void usage(void)
+{
+    printf("Usage: pngcompare [options] <file 1> <file 2> [<file 1> <file 2>...]\n"
+           "Prints a line of JSON per pair of images with their distance, PSNR and SSIM.\n"
+           "Exits with status 1 if any pair exceeds a threshold, 2 if any pair can't be compared.\n"
+           "\n"
+           "Options:\n"
+           "  --max-distance <d>    Fail pairs whose normalized RMS distance exceeds <d>\n"
+           "  --min-psnr <dB>       Fail pairs whose PSNR is below <dB>\n"
+           "  --min-ssim <s>        Fail pairs whose SSIM is below <s>\n"
+           "  --jobs <n>            Compare <n> pairs at a time (default 1)\n"
+           "  --16-bit              Compare 16-bit images at full precision instead of 8 bits\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"max-distance", required_argument, NULL, 'd'},
+        {"min-psnr",     required_argument, NULL, 'p'},
+        {"min-ssim",     required_argument, NULL, 's'},
+        {"jobs",         required_argument, NULL, 'j'},
+        {"16-bit",       no_argument,       NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+    double max_distance = INFINITY;
+    double min_psnr = -INFINITY;
+    double min_ssim = -INFINITY;
+    int jobs = 1;
+    int keep_16 = 0;
+    int opt, i;
+
+    while ((opt = getopt_long(argc, argv, "+", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            max_distance = atof(optarg);
+            break;
+        case 'p':
+            min_psnr = atof(optarg);
+            break;
+        case 's':
+            min_ssim = atof(optarg);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'b':
+            keep_16 = 1;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (argc - optind < 2 || (argc - optind) % 2 != 0 || jobs < 1) {
+        usage();
+        return 2;
+    }
+
+    struct work_queue queue;
+    queue.count = (argc - optind) / 2;
+    queue.next = 0;
+    queue.keep_16 = keep_16;
+    queue.comparisons = (struct comparison*) calloc(queue.count, sizeof(struct comparison));
+    if (!queue.comparisons) {
+        abort_("Failed to allocate memory for %d comparisons", queue.count);
+    }
+    for (i=0; i < queue.count; i++) {
+        queue.comparisons[i].filename_1 = argv[optind + 2*i];
+        queue.comparisons[i].filename_2 = argv[optind + 2*i + 1];
+    }
+    pthread_mutex_init(&queue.mutex, NULL);
+
+    if (jobs > queue.count) {
+        jobs = queue.count;
+    }
+    pthread_t* threads = (pthread_t*) malloc(sizeof(pthread_t) * jobs);
+    if (!threads) {
+        abort_("Failed to allocate memory for %d threads", jobs);
+    }
+    for (i=0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, compare_worker, &queue) != 0) {
+            abort_("Failed to start comparison thread");
+        }
+    }
+    for (i=0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int status = 0;
+    for (i=0; i < queue.count; i++) {
+        struct comparison* comparison = &(queue.comparisons[i]);
+        printf("{\"file_1\":");
+        print_json_string(comparison->filename_1);
+        printf(",\"file_2\":");
+        print_json_string(comparison->filename_2);
+        if (comparison->error) {
+            printf(",\"error\":");
+            print_json_string(comparison->error);
+            printf("}\n");
+            status = 2;
+            continue;
+        }
+
+        struct compare_result result = comparison->result;
+        int pass = result.distance <= max_distance && result.psnr >= min_psnr && result.ssim >= min_ssim;
+        printf(",\"distance\":%f,\"mse\":%f,", result.distance, result.mse);
+        if (isinf(result.psnr)) {
+            /* Identical images; JSON has no infinity */
+            printf("\"psnr\":null,");
+        } else {
+            printf("\"psnr\":%f,", result.psnr);
+        }
+        printf("\"ssim\":%f,\"pass\":%s}\n", result.ssim, pass ? "true" : "false");
+        if (!pass && status == 0) {
+            status = 1;
+        }
+    }
+
+    pthread_mutex_destroy(&queue.mutex);
+    free(threads);
+    free(queue.comparisons);
+    return status;
+}
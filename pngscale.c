@@ -25,26 +25,420 @@ under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
 
 #include "png_utils.h"
 #include "utils.h"
+#include "cache.h"
+#include "side_outputs.h"
 
 #include <stdlib.h> /* abort */
 #include <stdint.h> /* uint64_t */
 #include <limits.h> /* INT_MAX */
+#include <string.h> /* memset */
 #include <math.h>
 #include <assert.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h> /* sysconf */
 
 #include <png.h>
 
 #define ROUND_DIV(x,y) (((x) + (y)/2)/(y))
 #define SWAP(x,y,type)  do { type temp = x; x = y; y = temp; } while(0)
 
-static void scale_png_up(struct png_info read, struct png_info write);
-static void scale_png_down(struct png_info read, struct png_info write);
-static void scale_png_down_no_alpha(struct png_info read, struct png_info write);
+/* Bump whenever a change to the scaling code alters its output, so
+   stale cache entries are not served */
+#define CACHE_FORMAT_VERSION 2
+#define DEFAULT_CACHE_MAX_MB 1024
+#define DEFAULT_TAIL_TIMEOUT 30
+
+/* Output columns per strip are rounded to a multiple of this, so that
+   no two strips' sums share a 64-byte cache line */
+#define STRIP_ALIGNMENT 8
+
+/* Side of the square blocks in which a rotated output is transposed, so
+   that the rows of the scaled image one block reads stay in cache */
+#define TRANSPOSE_BLOCK 32
+
+/* With --approximate, downscaling by at least this many input columns
+   per output column samples APPROXIMATE_SAMPLES of them per input row
+   instead of accumulating all of them */
+#define APPROXIMATE_MIN_RATIO 64
+#define APPROXIMATE_SAMPLES 16
+
+enum scaler
+{
+    SCALER_UP,
+    SCALER_MIXED,
+    SCALER_DOWN_NO_ALPHA,
+    SCALER_DOWN_INTEGER,
+    SCALER_DOWN,
+    SCALER_DOWN_16,
+    SCALER_DOWN_SAMPLED
+};
+static const char* scaler_names[] = { "up", "mixed", "down_no_alpha", "down_integer", "down", "down_16",
+                                      "down_sampled" };
+
+/* Sums of 16-bit samples weighted by 16-bit alpha and by pixel fractions
+   can pass 64 bits on images of a few gigapixels */
+typedef unsigned __int128 uint128_t;
+
+struct scale_options
+{
+    int threads; /* threads accumulating column strips when downscaling */
+    struct side_outputs* side; /* NULL unless side outputs were requested */
+    struct tile* tile;         /* NULL unless scaling into a contact sheet */
+    struct reorientation* reorient; /* NULL unless the output is rotated or flipped */
+    int approximate; /* sample columns when downscaling by APPROXIMATE_MIN_RATIO or more */
+};
+
+/* EXIF orientations 1-8 as a transpose followed by mirroring: pixel (x, y)
+   of the reoriented image is the pixel of the scaled image found by
+   swapping x and y if transpose is set, then mirroring along each
+   flipped axis */
+static const struct { int transpose, flip_x, flip_y; } orientations[] = {
+    { 0, 0, 0 }, /* unused */
+    { 0, 0, 0 }, { 0, 1, 0 }, { 0, 1, 1 }, { 0, 0, 1 },
+    { 1, 0, 0 }, { 1, 0, 1 }, { 1, 1, 1 }, { 1, 1, 0 }
+};
+#define orientation_transposes(orientation) (orientations[orientation].transpose)
+
+/* The whole scaled image, held so that it can be written rotated and/or
+   flipped once its last row arrives. Output is normally far smaller than
+   input, so this costs little next to rotating the input. */
+struct reorientation
+{
+    int orientation;         /* EXIF orientation, 2-8 */
+    struct png_info display; /* the output as written, after reorientation */
+    png_bytep pixels;        /* the scaled image before reorientation */
+    int row;                 /* next row of pixels to be filled */
+};
+
+/* One input row's contribution to the output row sums */
+struct row_accumulation
+{
+    png_bytep read_row;
+    uint64_t* write_row_sums;
+    uint64_t* write_next_row_sums;
+    uint64_t* read_areas;          /* NULL when the image has no alpha */
+    uint64_t* read_areas_next_row;
+    unsigned int fraction_in_current_row;
+    unsigned int fraction_in_next_row;
+};
+
+struct strip_pool
+{
+    int strips;
+    int* first_cols; /* strips + 1 output column boundaries */
+    pthread_t* threads;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    struct png_info read;
+    struct png_info write;
+    struct row_accumulation* acc;
+    struct strip_worker* workers;
+    int quit;
+};
+
+struct strip_worker
+{
+    struct strip_pool* pool;
+    int strip;
+};
+
+/* One input of a contact sheet, scaled into the sheet's current band of
+   rows rather than to a file of its own */
+struct tile
+{
+    const char* file_name;
+    png_bytep* band_rows;
+    int x;        /* left edge of the scaled image in the band */
+    int y;        /* top edge of the scaled image in the band */
+    int width;
+    int height;
+    int row;      /* next row of the scaled image to be copied */
+};
+
+/* The tiles of one band, handed out to the threads scaling them */
+struct tile_queue
+{
+    pthread_mutex_t mutex;
+    struct tile* tiles;
+    int count;
+    int next;
+    int tile_width;
+    int tile_height;
+    int orientation; /* applied after the EXIF orientation if auto_orient is set */
+    int auto_orient;
+    int approximate;
+};
+
+static void write_row(struct png_info write, png_bytep row, struct scale_options options);
+static void finish_write(struct png_info write, struct scale_options options);
+static void output_row(struct png_info write, png_bytep row, struct scale_options options);
+static void orientation_matrix(int orientation, int matrix[2][2]);
+static int compose_orientations(int first, int second);
+static struct reorientation* start_reorientation(struct png_info* write, int orientation);
+static void write_reoriented_rows(struct reorientation* reorient, struct png_info write, struct scale_options options);
+static void copy_to_tile(struct tile* tile, struct png_info write, png_bytep row);
+static void scale_png(struct png_info read, struct png_info write, struct scale_options options);
+static void scale_png_up(struct png_info read, struct png_info write, struct scale_options options);
+static void scale_png_down(struct png_info read, struct png_info write, struct scale_options options);
+static void scale_png_down_no_alpha(struct png_info read, struct png_info write, struct scale_options options);
+static void scale_png_down_16(struct png_info read, struct png_info write, struct scale_options options);
+static inline uint32_t sample_offset(uint32_t y, uint32_t x, uint32_t k);
+static inline void accumulate_samples(struct png_info read, struct png_info write, png_bytep read_row, int y,
+                                      const int* first_cols, uint64_t* sums, uint64_t* areas,
+                                      unsigned int fraction_in_row, int bit_depth);
+static void scale_png_down_sampled(struct png_info read, struct png_info write, struct scale_options options);
+static void accumulate_partial_pixel(struct png_info read, struct png_info write, struct row_accumulation* acc,
+                                     png_bytep read_ptr, int write_x, unsigned int fraction_in_col);
+static void accumulate_row(struct png_info read, struct png_info write, struct row_accumulation* acc,
+                           int first_col, int end_col);
+static void accumulate_row_no_alpha(struct png_info read, struct png_info write, struct row_accumulation* acc,
+                                    int first_col, int end_col);
+static void* strip_worker_main(void* arg);
+static struct strip_pool* start_strip_pool(struct png_info read, struct png_info write, int threads);
+static void accumulate_row_in_strips(struct strip_pool* pool, struct row_accumulation* acc);
+static void stop_strip_pool(struct strip_pool* pool);
+static uint64_t* alloc_sums(struct png_info write);
+static void scale_png_mixed(struct png_info read, struct png_info write, struct scale_options options);
+static void scale_png_down_integer(struct png_info read, struct png_info write, struct scale_options options);
+static inline void sum_blocks(png_bytep read_row, uint64_t* sums, int write_width, int channels, int x_ratio);
+static void sum_blocks_2(png_bytep read_row, uint64_t* sums, int write_width, int channels);
+static void sum_blocks_4(png_bytep read_row, uint64_t* sums, int write_width, int channels);
+static void sum_blocks_8(png_bytep read_row, uint64_t* sums, int write_width, int channels);
+static void box_filter_row(png_bytep read_row, int read_width, png_bytep write_row, int write_width,
+                           int channels, int bit_depth, uint64_t* sums, uint64_t* areas);
+static void interpolate_row(png_bytep read_row, int read_width, png_bytep write_row, int write_width,
+                            int channels, int bit_depth);
 static struct png_info compute_write_info(struct png_info read, int max_width, int max_height);
+static enum scaler choose_scaler(struct png_info read, struct png_info write, int approximate);
+static uint64_t estimate_working_set(struct png_info read, struct png_info write, enum scaler scaler);
+static int probe(const char* read_file_name, int width, int height, int keep_16,
+                 int orientation, int auto_orient, int approximate);
+static void side_outputs_from_png(const char* file_name, const char* side_outputs_file_name);
+static void* tile_worker(void* arg);
+static void make_contact_sheet(const char* write_file_name, char** read_file_names, int count,
+                               int columns, int tile_width, int tile_height, int threads,
+                               int orientation, int auto_orient, int approximate);
+static void usage(void);
 int main(int argc, char **argv);
 #define has_alpha_channel(png_info) ((png_info).channels == 2 || (png_info).channels == 4)
+#define max_sample(bit_depth) ((bit_depth) == 16 ? 65535 : 255)
+
+/* Sample i of a row at either bit depth; rows of 16-bit images hold
+   native uint16_t samples (see open_read_png_depth) */
+static inline unsigned int get_sample(png_bytep row, int i, int bit_depth)
+{
+    return bit_depth == 16 ? ((uint16_t*)row)[i] : row[i];
+}
+
+static inline void set_sample(png_bytep row, int i, int bit_depth, unsigned int value)
+{
+    if (bit_depth == 16) {
+        ((uint16_t*)row)[i] = value;
+    } else {
+        row[i] = value;
+    }
+}
+
+void write_row(struct png_info write, png_bytep row, struct scale_options options)
+{
+    if (options.reorient) {
+        memcpy(&(options.reorient->pixels[(size_t)options.reorient->row * write.rowbytes]), row, write.rowbytes);
+        options.reorient->row++;
+    } else {
+        output_row(write, row, options);
+    }
+}
+
+/* Sends a row of the final image to the output file or contact sheet */
+void output_row(struct png_info write, png_bytep row, struct scale_options options)
+{
+    if (options.tile) {
+        copy_to_tile(options.tile, write, row);
+    } else {
+        png_write_row(write.png_ptr, row);
+    }
+    if (options.side) {
+        side_outputs_add_row(options.side, row);
+    }
+}
+
+void finish_write(struct png_info write, struct scale_options options)
+{
+    if (options.reorient) {
+        write_reoriented_rows(options.reorient, write, options);
+        write = options.reorient->display;
+        free(options.reorient->pixels);
+        free(options.reorient);
+    }
+    if (!options.tile) {
+        close_write_png(write);
+    }
+}
+
+/* The linear part of the coordinate mapping of an orientation */
+void orientation_matrix(int orientation, int matrix[2][2])
+{
+    int sign_x = orientations[orientation].flip_x ? -1 : 1;
+    int sign_y = orientations[orientation].flip_y ? -1 : 1;
+    int transpose = orientations[orientation].transpose;
+    matrix[0][0] = transpose ? 0 : sign_x;
+    matrix[0][1] = transpose ? sign_x : 0;
+    matrix[1][0] = transpose ? sign_y : 0;
+    matrix[1][1] = transpose ? 0 : sign_y;
+}
+
+/* The orientation equivalent to reorienting by first and then by second */
+int compose_orientations(int first, int second)
+{
+    int a[2][2], b[2][2], c[2][2];
+    int i, j, orientation;
+    orientation_matrix(first, a);
+    orientation_matrix(second, b);
+    for (orientation=1; orientation <= 8; orientation++) {
+        int match = 1;
+        orientation_matrix(orientation, c);
+        for (i=0; i < 2; i++) {
+            for (j=0; j < 2; j++) {
+                match &= c[i][j] == a[i][0] * b[0][j] + a[i][1] * b[1][j];
+            }
+        }
+        if (match) {
+            return orientation;
+        }
+    }
+    assert(0);
+    return 1;
+}
+
+/* Sets up holding an image scaled to write's size, so that it can be
+   written reoriented. The returned display gives the size of the output
+   to open. */
+struct reorientation* start_reorientation(struct png_info* write, int orientation)
+{
+    struct reorientation* reorient = (struct reorientation*) malloc(sizeof(struct reorientation));
+    write->channels = get_channels_per_pixel(*write);
+    write->rowbytes = write->width * write->channels * (write->bit_depth / 8);
+    if (reorient) {
+        reorient->pixels = (png_bytep) malloc((size_t)write->rowbytes * write->height);
+    }
+    if (!reorient || !reorient->pixels) {
+        abort_("Failed to allocate memory to hold the scaled image for reorientation");
+    }
+    reorient->orientation = orientation;
+    reorient->display = *write;
+    if (orientation_transposes(orientation)) {
+        reorient->display.width = write->height;
+        reorient->display.height = write->width;
+        reorient->display.rowbytes = write->height * write->channels * (write->bit_depth / 8);
+    }
+    reorient->row = 0;
+    return reorient;
+}
 
-void scale_png_up(struct png_info read, struct png_info write)
+/* Writes the held image reoriented, a band of TRANSPOSE_BLOCK rows at a
+   time. Bands are filled in square blocks, so that when the orientation
+   transposes, each block reads from only TRANSPOSE_BLOCK rows of the
+   scaled image instead of striding across all of them for every pixel. */
+void write_reoriented_rows(struct reorientation* reorient, struct png_info write, struct scale_options options)
+{
+    struct png_info display = reorient->display;
+    int transpose = orientations[reorient->orientation].transpose;
+    int flip_x = orientations[reorient->orientation].flip_x;
+    int flip_y = orientations[reorient->orientation].flip_y;
+    int pixel_bytes = write.channels * (write.bit_depth / 8);
+    int band, block, x, y;
+
+    png_bytep band_buffer = (png_byte*) malloc((size_t)display.rowbytes * TRANSPOSE_BLOCK);
+    if (!band_buffer) {
+        abort_("Failed to allocate memory to hold rows of the reoriented image");
+    }
+    for (band=0; band < display.height; band += TRANSPOSE_BLOCK) {
+        int band_end = band + TRANSPOSE_BLOCK < display.height ? band + TRANSPOSE_BLOCK : display.height;
+        for (block=0; block < display.width; block += TRANSPOSE_BLOCK) {
+            int block_end = block + TRANSPOSE_BLOCK < display.width ? block + TRANSPOSE_BLOCK : display.width;
+            for (y=band; y < band_end; y++) {
+                png_bytep out = &(band_buffer[(size_t)(y - band) * display.rowbytes + block * pixel_bytes]);
+                for (x=block; x < block_end; x++) {
+                    int source_x = transpose ? y : x;
+                    int source_y = transpose ? x : y;
+                    if (flip_x) {
+                        source_x = write.width - 1 - source_x;
+                    }
+                    if (flip_y) {
+                        source_y = write.height - 1 - source_y;
+                    }
+                    memcpy(out, &(reorient->pixels[(size_t)source_y * write.rowbytes + source_x * pixel_bytes]), pixel_bytes);
+                    out += pixel_bytes;
+                }
+            }
+        }
+        for (y=band; y < band_end; y++) {
+            output_row(display, &(band_buffer[(size_t)(y - band) * display.rowbytes]), options);
+        }
+    }
+    free(band_buffer);
+}
+
+/* Places a scaled row in the band, converted to the sheet's RGBA */
+void copy_to_tile(struct tile* tile, struct png_info write, png_bytep row)
+{
+    int x;
+    png_bytep out = &(tile->band_rows[tile->y + tile->row][tile->x * 4]);
+    for (x=0; x < write.width; x++) {
+        png_bytep in = &(row[x*write.channels]);
+        switch (write.channels) {
+        case 1:
+            out[0] = out[1] = out[2] = in[0];
+            out[3] = 255;
+            break;
+        case 2:
+            out[0] = out[1] = out[2] = in[0];
+            out[3] = in[1];
+            break;
+        case 3:
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
+            out[3] = 255;
+            break;
+        default:
+            memcpy(out, in, 4);
+            break;
+        }
+        out += 4;
+    }
+    tile->row++;
+}
+
+void scale_png(struct png_info read, struct png_info write, struct scale_options options)
+{
+    switch (choose_scaler(read, write, options.approximate)) {
+    case SCALER_UP:
+        scale_png_up(read, write, options);
+        break;
+    case SCALER_MIXED:
+        scale_png_mixed(read, write, options);
+        break;
+    case SCALER_DOWN_NO_ALPHA:
+        scale_png_down_no_alpha(read, write, options);
+        break;
+    case SCALER_DOWN_INTEGER:
+        scale_png_down_integer(read, write, options);
+        break;
+    case SCALER_DOWN:
+        scale_png_down(read, write, options);
+        break;
+    case SCALER_DOWN_16:
+        scale_png_down_16(read, write, options);
+        break;
+    case SCALER_DOWN_SAMPLED:
+        scale_png_down_sampled(read, write, options);
+        break;
+    }
+}
+
+void scale_png_up(struct png_info read, struct png_info write, struct scale_options options)
 {
     int x, y, c;
 
@@ -65,8 +459,8 @@ void scale_png_up(struct png_info read, struct png_info write)
 
     /* Using floating point in this procedure because performance isn't a
        concern - upscaling is rare and generally involves small images. */
-    png_read_row(read.png_ptr, read_row_pointer, NULL);
-    png_read_row(read.png_ptr, read_next_row_pointer, NULL);
+    read_png_row(read, read_row_pointer);
+    read_png_row(read, read_next_row_pointer);
     /* Subtracting 1 because our read pixels are conceptually being
        sampled at the upper-left corner of each pixel, so the bottom-
        right corners have no value. */
@@ -81,7 +475,7 @@ void scale_png_up(struct png_info read, struct png_info write)
             int i;
             for (i=0; i < int_part_y - old_int_part_y; i++) {
                 SWAP(read_row_pointer, read_next_row_pointer, png_bytep);
-                png_read_row(read.png_ptr, read_next_row_pointer, NULL);
+                read_png_row(read, read_next_row_pointer);
             }
         }
         for (x=0; x < write.width; x++) {
@@ -90,28 +484,28 @@ void scale_png_up(struct png_info read, struct png_info write)
             int read_x = (int)read_x_dbl;
             double fraction_from_right_col = 1.0 - fraction_from_left_col;
 
-            png_byte* read_above_left_ptr = &(read_row_pointer[read_x*read.channels]);
-            png_byte* read_below_left_ptr = &(read_next_row_pointer[read_x*read.channels]);
-            png_byte* read_above_right_ptr = &(read_row_pointer[(read_x + 1)*read.channels]);
-            png_byte* read_below_right_ptr = &(read_next_row_pointer[(read_x + 1)*read.channels]);
-            png_byte* write_ptr = &(write_row_pointer[x*write.channels]);
+            int left = read_x*read.channels;
+            int right = (read_x + 1)*read.channels;
             for (c=0; c < write.channels; c++) {
-                double val = read_above_left_ptr[c]  * fraction_from_above_row * fraction_from_left_col + 
-                             read_above_right_ptr[c] * fraction_from_above_row * fraction_from_right_col + 
-                             read_below_left_ptr[c]  * fraction_from_below_row * fraction_from_left_col + 
-                             read_below_right_ptr[c] * fraction_from_below_row * fraction_from_right_col;
-                write_ptr[c] = (int)round(val);
+                double val = get_sample(read_row_pointer, left + c, read.bit_depth)       * fraction_from_above_row * fraction_from_left_col + 
+                             get_sample(read_row_pointer, right + c, read.bit_depth)      * fraction_from_above_row * fraction_from_right_col + 
+                             get_sample(read_next_row_pointer, left + c, read.bit_depth)  * fraction_from_below_row * fraction_from_left_col + 
+                             get_sample(read_next_row_pointer, right + c, read.bit_depth) * fraction_from_below_row * fraction_from_right_col;
+                set_sample(write_row_pointer, x*write.channels + c, write.bit_depth, (int)round(val));
             }
         }
 
-        png_write_row(write.png_ptr, write_row_pointer);
+        write_row(write, write_row_pointer, options);
     }
 
+    free(read_row_pointer);
+    free(read_next_row_pointer);
+    free(write_row_pointer);
     close_read_png(read);
-    close_write_png(write);
+    finish_write(write, options);
 }
 
-void scale_png_down(struct png_info read, struct png_info write)
+void scale_png_down(struct png_info read, struct png_info write, struct scale_options options)
 {
     int x, y, c;
 
@@ -121,10 +515,10 @@ void scale_png_down(struct png_info read, struct png_info write)
         abort_("Failed to allocate memory to hold one row of input PNG image");
     }
 
-    uint64_t* write_row_sums_pointer = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
-    uint64_t* write_next_row_sums_pointer = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
-    uint64_t* read_areas = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
-    uint64_t* read_areas_next_row = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
+    uint64_t* write_row_sums_pointer = alloc_sums(write);
+    uint64_t* write_next_row_sums_pointer = alloc_sums(write);
+    uint64_t* read_areas = alloc_sums(write);
+    uint64_t* read_areas_next_row = alloc_sums(write);
     if (!write_row_sums_pointer || !write_next_row_sums_pointer || !read_areas || !read_areas_next_row) {
         abort_("Failed to allocate memory - need enough to hold nine rows of output PNG image");
     }
@@ -138,9 +532,10 @@ void scale_png_down(struct png_info read, struct png_info write)
     memset(write_next_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
     memset(read_areas, 0, sizeof(uint64_t) * write.width * write.channels);
     memset(read_areas_next_row, 0, sizeof(uint64_t) * write.width * write.channels);
+    struct strip_pool* pool = options.threads > 1 ? start_strip_pool(read, write, options.threads) : NULL;
     int y_frac = 0;
     for (y=0; y < read.height; y++) {
-        png_read_row(read.png_ptr, read_row_pointer, NULL);
+        read_png_row(read, read_row_pointer);
 
         int end_of_row = 0;
         unsigned int fraction_in_current_row = write.height; /* Proportion represented by integer between 0 and write.height */
@@ -154,12 +549,103 @@ void scale_png_down(struct png_info read, struct png_info write)
             fraction_in_next_row = y_frac;
         }
 
+        struct row_accumulation acc = { read_row_pointer, write_row_sums_pointer, write_next_row_sums_pointer,
+                                        read_areas, read_areas_next_row,
+                                        fraction_in_current_row, fraction_in_next_row };
+        if (pool) {
+            accumulate_row_in_strips(pool, &acc);
+        } else {
+            accumulate_row(read, write, &acc, 0, write.width);
+        }
+
+        if (end_of_row) {
+            for (x=0; x < write.width; x++) {
+                png_byte* write_ptr = &(write_row_pointer[x*write.channels]);
+                uint64_t* write_sums_ptr = &(write_row_sums_pointer[x*write.channels]);
+                uint64_t* read_areas_ptr = &(read_areas[x*write.channels]);
+                for (c=0; c < write.channels; c++) {
+                    if (read_areas_ptr[c] == 0) {
+                        /* Fully transparent pixel, value is irrelevant */
+                        write_ptr[c] = 0;
+                    } else {
+                        write_ptr[c] = ROUND_DIV(write_sums_ptr[c], read_areas_ptr[c]);
+                    }
+                }
+            }
+
+            write_row(write, write_row_pointer, options);
+            SWAP(write_row_sums_pointer, write_next_row_sums_pointer, uint64_t*);
+            memset(write_next_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
+            SWAP(read_areas, read_areas_next_row, uint64_t*);
+            memset(read_areas_next_row, 0, sizeof(uint64_t) * write.width * write.channels);
+        }
+    }
+
+    if (pool) {
+        stop_strip_pool(pool);
+    }
+    free(read_row_pointer);
+    free(write_row_sums_pointer);
+    free(write_next_row_sums_pointer);
+    free(read_areas);
+    free(read_areas_next_row);
+    free(write_row_pointer);
+    close_read_png(read);
+    finish_write(write, options);
+}
+
+/* As scale_png_down, for 16-bit samples, with 128-bit color sums.
+   Images without alpha are weighted by a constant alpha of 65535 and go
+   through the same code; the 16-bit path is single-threaded. */
+void scale_png_down_16(struct png_info read, struct png_info write, struct scale_options options)
+{
+    int x, y, c;
+    int n = write.width * write.channels;
+
+    uint16_t* read_row_pointer = (uint16_t*) malloc(read.rowbytes);
+    if (!read_row_pointer) {
+        abort_("Failed to allocate memory to hold one row of input PNG image");
+    }
+
+    uint128_t* write_row_sums_pointer = (uint128_t*) malloc(sizeof(uint128_t) * n);
+    uint128_t* write_next_row_sums_pointer = (uint128_t*) malloc(sizeof(uint128_t) * n);
+    uint64_t* read_areas = alloc_sums(write);
+    uint64_t* read_areas_next_row = alloc_sums(write);
+    if (!write_row_sums_pointer || !write_next_row_sums_pointer || !read_areas || !read_areas_next_row) {
+        abort_("Failed to allocate memory - need enough to hold twenty-four rows of output PNG image");
+    }
+
+    uint16_t* write_row_pointer = (uint16_t*) malloc(write.rowbytes);
+    if (!write_row_pointer) {
+        abort_("Failed to allocate memory to hold one row of output PNG image");
+    }
+
+    memset(write_row_sums_pointer, 0, sizeof(uint128_t) * n);
+    memset(write_next_row_sums_pointer, 0, sizeof(uint128_t) * n);
+    memset(read_areas, 0, sizeof(uint64_t) * n);
+    memset(read_areas_next_row, 0, sizeof(uint64_t) * n);
+    int y_frac = 0;
+    for (y=0; y < read.height; y++) {
+        read_png_row(read, (png_bytep) read_row_pointer);
+
+        int end_of_row = 0;
+        uint64_t fraction_in_current_row = write.height; /* Proportion represented by integer between 0 and write.height */
+        uint64_t fraction_in_next_row = 0;
+        y_frac += write.height;
+        if (y_frac >= read.height) {
+            /* We've reached a boundary between output image rows. */
+            end_of_row = 1;
+            y_frac -= read.height;
+            fraction_in_current_row = write.height - y_frac;
+            fraction_in_next_row = y_frac;
+        }
+
         int write_x = 0;
         int x_frac = 0;
         for (x=0; x < read.width; x++) {
             int end_of_col = 0;
-            unsigned int fraction_in_current_col = write.width; /* Proportion represented by integer between 0 and write.width */
-            unsigned int fraction_in_next_col = 0;
+            uint64_t fraction_in_current_col = write.width; /* Proportion represented by integer between 0 and write.width */
+            uint64_t fraction_in_next_col = 0;
             x_frac += write.width;
             if (x_frac >= read.width) {
                 /* We've reached a boundary between output image columns. */
@@ -169,30 +655,31 @@ void scale_png_down(struct png_info read, struct png_info write)
                 fraction_in_next_col = x_frac;
             }
 
-            png_byte* read_ptr = &(read_row_pointer[x*read.channels]);
+            uint64_t weights[4] = { fraction_in_current_col * fraction_in_current_row,
+                                    fraction_in_next_col * fraction_in_current_row,
+                                    fraction_in_current_col * fraction_in_next_row,
+                                    fraction_in_next_col * fraction_in_next_row };
+            uint16_t* read_ptr = &(read_row_pointer[x*read.channels]);
             for (c=0; c < write.channels; c++) {
-                uint64_t value = read_ptr[c];
-                uint64_t alpha = 255;
+                uint64_t alpha = 65535;
                 if (has_alpha_channel(read) && c < read.channels - 1) {
                     alpha = read_ptr[read.channels - 1];
                 }
-                write_row_sums_pointer[write.channels*write_x + c] +=
-                    value * fraction_in_current_col * fraction_in_current_row * alpha / 255;
-                read_areas[write.channels*write_x + c] += fraction_in_current_col * fraction_in_current_row * alpha / 255;
+                uint64_t value = read_ptr[c] * alpha;
+                int i = write.channels*write_x + c;
+                write_row_sums_pointer[i] += (uint128_t)value * weights[0];
+                read_areas[i] += weights[0] * alpha;
                 if (fraction_in_next_col) {
-                    write_row_sums_pointer[write.channels*(write_x + 1) + c] +=
-                        value * fraction_in_next_col * fraction_in_current_row * alpha / 255;
-                    read_areas[write.channels*(write_x + 1) + c] += fraction_in_next_col * fraction_in_current_row * alpha / 255;
+                    write_row_sums_pointer[i + write.channels] += (uint128_t)value * weights[1];
+                    read_areas[i + write.channels] += weights[1] * alpha;
                 }
                 if (fraction_in_next_row) {
-                    write_next_row_sums_pointer[write.channels*write_x + c] +=
-                        value * fraction_in_current_col * fraction_in_next_row * alpha / 255;
-                    read_areas_next_row[write.channels*write_x + c] += fraction_in_current_col * fraction_in_next_row * alpha / 255;
+                    write_next_row_sums_pointer[i] += (uint128_t)value * weights[2];
+                    read_areas_next_row[i] += weights[2] * alpha;
                 }
                 if (fraction_in_next_col && fraction_in_next_row) {
-                    write_next_row_sums_pointer[write.channels*(write_x + 1) + c] +=
-                        value * fraction_in_next_col * fraction_in_next_row * alpha / 255;
-                    read_areas_next_row[write.channels*(write_x + 1) + c] += fraction_in_next_col * fraction_in_next_row * alpha / 255;
+                    write_next_row_sums_pointer[i + write.channels] += (uint128_t)value * weights[3];
+                    read_areas_next_row[i + write.channels] += weights[3] * alpha;
                 }
             }
 
@@ -202,22 +689,167 @@ void scale_png_down(struct png_info read, struct png_info write)
             }
         }
 
+        if (end_of_row) {
+            for (x=0; x < n; x++) {
+                if (read_areas[x] == 0) {
+                    /* Fully transparent pixel, value is irrelevant */
+                    write_row_pointer[x] = 0;
+                } else {
+                    write_row_pointer[x] = ROUND_DIV(write_row_sums_pointer[x], read_areas[x]);
+                }
+            }
+
+            write_row(write, (png_bytep) write_row_pointer, options);
+            SWAP(write_row_sums_pointer, write_next_row_sums_pointer, uint128_t*);
+            memset(write_next_row_sums_pointer, 0, sizeof(uint128_t) * n);
+            SWAP(read_areas, read_areas_next_row, uint64_t*);
+            memset(read_areas_next_row, 0, sizeof(uint64_t) * n);
+        }
+    }
+
+    free(read_row_pointer);
+    free(write_row_sums_pointer);
+    free(write_next_row_sums_pointer);
+    free(read_areas);
+    free(read_areas_next_row);
+    free(write_row_pointer);
+    close_read_png(read);
+    finish_write(write, options);
+}
+
+/* Deterministic pseudo-random 32-bit fraction choosing the column taken
+   for sample k of output column x on input row y */
+static inline uint32_t sample_offset(uint32_t y, uint32_t x, uint32_t k)
+{
+    uint32_t h = y * 0x9e3779b1u ^ x * 0x85ebca77u ^ k * 0xc2b2ae3du;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+/* Adds the samples of one input row to the sums and areas of the output
+   row it falls in. Inlined into scale_png_down_sampled with a constant
+   bit depth, so the sample loads compile to plain byte or uint16_t loads. */
+static inline void accumulate_samples(struct png_info read, struct png_info write, png_bytep read_row, int y,
+                                      const int* first_cols, uint64_t* sums, uint64_t* areas,
+                                      unsigned int fraction_in_row, int bit_depth)
+{
+    int x, c, k;
+    int alpha_channel = has_alpha_channel(read) ? read.channels - 1 : -1;
+    uint64_t max_weight = (uint64_t)max_sample(bit_depth) * fraction_in_row;
+    for (x=0; x < write.width; x++) {
+        uint64_t* sums_ptr = &(sums[x*write.channels]);
+        uint64_t* areas_ptr = &(areas[x*write.channels]);
+        int span = first_cols[x + 1] - first_cols[x];
+        for (k=0; k < APPROXIMATE_SAMPLES; k++) {
+            int stratum_start = first_cols[x] + (int)((uint64_t)span * k / APPROXIMATE_SAMPLES);
+            int stratum_end = first_cols[x] + (int)((uint64_t)span * (k + 1) / APPROXIMATE_SAMPLES);
+            int read_x = stratum_start + (int)(((uint64_t)sample_offset(y, x, k) * (stratum_end - stratum_start)) >> 32);
+            int read_i = read_x * read.channels;
+            uint64_t alpha_weight = alpha_channel < 0 ? max_weight :
+                (uint64_t)get_sample(read_row, read_i + alpha_channel, bit_depth) * fraction_in_row;
+            for (c=0; c < write.channels; c++) {
+                uint64_t weight = c == alpha_channel ? max_weight : alpha_weight;
+                sums_ptr[c] += get_sample(read_row, read_i + c, bit_depth) * weight;
+                areas_ptr[c] += weight;
+            }
+        }
+    }
+}
+
+/* Approximates scale_png_down for large reductions. Rather than every
+   input column, each input row contributes one column from each of
+   APPROXIMATE_SAMPLES equal strata of the columns under an output pixel,
+   at a position within the stratum that changes from row to row, so the
+   samples spread over the pixel's whole area. Rows keep their exact
+   fractional weights, since every row has to be decoded anyway. Handles
+   either bit depth: with only one fraction per sample the sums stay
+   within 64 bits. */
+void scale_png_down_sampled(struct png_info read, struct png_info write, struct scale_options options)
+{
+    int x, y, c;
+
+    /* Read and write pixels */
+    png_bytep read_row_pointer = (png_byte*) malloc(read.rowbytes);
+    if (!read_row_pointer) {
+        abort_("Failed to allocate memory to hold one row of input PNG image");
+    }
+
+    uint64_t* write_row_sums_pointer = alloc_sums(write);
+    uint64_t* write_next_row_sums_pointer = alloc_sums(write);
+    uint64_t* read_areas = alloc_sums(write);
+    uint64_t* read_areas_next_row = alloc_sums(write);
+    int* first_cols = (int*) malloc(sizeof(int) * (write.width + 1));
+    if (!write_row_sums_pointer || !write_next_row_sums_pointer || !read_areas || !read_areas_next_row || !first_cols) {
+        abort_("Failed to allocate memory - need enough to hold nine rows of output PNG image");
+    }
+
+    png_bytep write_row_pointer = (png_byte*) malloc(write.rowbytes);
+    if (!write_row_pointer) {
+        abort_("Failed to allocate memory to hold one row of output PNG image");
+    }
+
+    memset(write_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
+    memset(write_next_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
+    memset(read_areas, 0, sizeof(uint64_t) * write.width * write.channels);
+    memset(read_areas_next_row, 0, sizeof(uint64_t) * write.width * write.channels);
+
+    /* Input columns wholly under each output column; pixels straddling
+       two output columns are just left to the first */
+    for (x=0; x <= write.width; x++) {
+        first_cols[x] = (uint64_t)x * read.width / write.width;
+    }
+
+    int y_frac = 0;
+    for (y=0; y < read.height; y++) {
+        read_png_row(read, read_row_pointer);
+
+        int end_of_row = 0;
+        unsigned int fraction_in_current_row = write.height; /* Proportion represented by integer between 0 and write.height */
+        unsigned int fraction_in_next_row = 0;
+        y_frac += write.height;
+        if (y_frac >= read.height) {
+            /* We've reached a boundary between output image rows. */
+            end_of_row = 1;
+            y_frac -= read.height;
+            fraction_in_current_row = write.height - y_frac;
+            fraction_in_next_row = y_frac;
+        }
+
+        /* A row straddling two output rows adds the same samples to both */
+        if (read.bit_depth == 16) {
+            accumulate_samples(read, write, read_row_pointer, y, first_cols, write_row_sums_pointer, read_areas,
+                               fraction_in_current_row, 16);
+            if (fraction_in_next_row) {
+                accumulate_samples(read, write, read_row_pointer, y, first_cols, write_next_row_sums_pointer,
+                                   read_areas_next_row, fraction_in_next_row, 16);
+            }
+        } else {
+            accumulate_samples(read, write, read_row_pointer, y, first_cols, write_row_sums_pointer, read_areas,
+                               fraction_in_current_row, 8);
+            if (fraction_in_next_row) {
+                accumulate_samples(read, write, read_row_pointer, y, first_cols, write_next_row_sums_pointer,
+                                   read_areas_next_row, fraction_in_next_row, 8);
+            }
+        }
+
         if (end_of_row) {
             for (x=0; x < write.width; x++) {
-                png_byte* write_ptr = &(write_row_pointer[x*write.channels]);
                 uint64_t* write_sums_ptr = &(write_row_sums_pointer[x*write.channels]);
                 uint64_t* read_areas_ptr = &(read_areas[x*write.channels]);
                 for (c=0; c < write.channels; c++) {
                     if (read_areas_ptr[c] == 0) {
                         /* Fully transparent pixel, value is irrelevant */
-                        write_ptr[c] = 0;
+                        set_sample(write_row_pointer, x*write.channels + c, write.bit_depth, 0);
                     } else {
-                        write_ptr[c] = ROUND_DIV(write_sums_ptr[c], read_areas_ptr[c]);
+                        set_sample(write_row_pointer, x*write.channels + c, write.bit_depth,
+                                   ROUND_DIV(write_sums_ptr[c], read_areas_ptr[c]));
                     }
                 }
             }
 
-            png_write_row(write.png_ptr, write_row_pointer);
+            write_row(write, write_row_pointer, options);
             SWAP(write_row_sums_pointer, write_next_row_sums_pointer, uint64_t*);
             memset(write_next_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
             SWAP(read_areas, read_areas_next_row, uint64_t*);
@@ -225,11 +857,18 @@ void scale_png_down(struct png_info read, struct png_info write)
         }
     }
 
+    free(read_row_pointer);
+    free(write_row_sums_pointer);
+    free(write_next_row_sums_pointer);
+    free(read_areas);
+    free(read_areas_next_row);
+    free(first_cols);
+    free(write_row_pointer);
     close_read_png(read);
-    close_write_png(write);
+    finish_write(write, options);
 }
 
-void scale_png_down_no_alpha(struct png_info read, struct png_info write)
+void scale_png_down_no_alpha(struct png_info read, struct png_info write, struct scale_options options)
 {
     int x, y, c;
 
@@ -239,8 +878,8 @@ void scale_png_down_no_alpha(struct png_info read, struct png_info write)
         abort_("Failed to allocate memory to hold one row of input PNG image");
     }
 
-    uint64_t* write_row_sums_pointer = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
-    uint64_t* write_next_row_sums_pointer = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
+    uint64_t* write_row_sums_pointer = alloc_sums(write);
+    uint64_t* write_next_row_sums_pointer = alloc_sums(write);
     uint64_t read_area = ((uint64_t)read.width) * read.height;
     if (!write_row_sums_pointer || !write_next_row_sums_pointer) {
         abort_("Failed to allocate memory - need enough to hold five rows of output PNG image");
@@ -253,9 +892,10 @@ void scale_png_down_no_alpha(struct png_info read, struct png_info write)
     
     memset(write_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
     memset(write_next_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
+    struct strip_pool* pool = options.threads > 1 ? start_strip_pool(read, write, options.threads) : NULL;
     int y_frac = 0;
     for (y=0; y < read.height; y++) {
-        png_read_row(read.png_ptr, read_row_pointer, NULL);
+        read_png_row(read, read_row_pointer);
 
         int end_of_row = 0;
         unsigned int fraction_in_current_row = write.height; /* Proportion represented by integer between 0 and write.height */
@@ -269,63 +909,653 @@ void scale_png_down_no_alpha(struct png_info read, struct png_info write)
             fraction_in_next_row = y_frac;
         }
 
-        int write_x = 0;
-        int x_frac = 0;
-        for (x=0; x < read.width; x++) {
-            int end_of_col = 0;
-            unsigned int fraction_in_current_col = write.width; /* Proportion represented by integer between 0 and write.width */
-            unsigned int fraction_in_next_col = 0;
-            x_frac += write.width;
-            if (x_frac >= read.width) {
-                /* We've reached a boundary between output image columns. */
-                end_of_col = 1;
-                x_frac -= read.width;
-                fraction_in_current_col = write.width - x_frac;
-                fraction_in_next_col = x_frac;
-            }
+        struct row_accumulation acc = { read_row_pointer, write_row_sums_pointer, write_next_row_sums_pointer,
+                                        NULL, NULL,
+                                        fraction_in_current_row, fraction_in_next_row };
+        if (pool) {
+            accumulate_row_in_strips(pool, &acc);
+        } else {
+            accumulate_row_no_alpha(read, write, &acc, 0, write.width);
+        }
 
-            png_byte* read_ptr = &(read_row_pointer[x*read.channels]);
-            for (c=0; c < write.channels; c++) {
-                uint64_t value = read_ptr[c];
-                write_row_sums_pointer[write.channels*write_x + c] +=
-                    value * fraction_in_current_col * fraction_in_current_row;
-                if (fraction_in_next_col) {
-                    write_row_sums_pointer[write.channels*(write_x + 1) + c] +=
-                        value * fraction_in_next_col * fraction_in_current_row;
+        if (end_of_row) {
+            for (x=0; x < write.width; x++) {
+                png_byte* write_ptr = &(write_row_pointer[x*write.channels]);
+                uint64_t* write_sums_ptr = &(write_row_sums_pointer[x*write.channels]);
+                for (c=0; c < write.channels; c++) {
+                    write_ptr[c] = ROUND_DIV(write_sums_ptr[c], read_area);
                 }
-                if (fraction_in_next_row) {
-                    write_next_row_sums_pointer[write.channels*write_x + c] +=
-                        value * fraction_in_current_col * fraction_in_next_row;
+            }
+
+            write_row(write, write_row_pointer, options);
+            SWAP(write_row_sums_pointer, write_next_row_sums_pointer, uint64_t*);
+            memset(write_next_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
+        }
+    }
+
+    if (pool) {
+        stop_strip_pool(pool);
+    }
+    free(read_row_pointer);
+    free(write_row_sums_pointer);
+    free(write_next_row_sums_pointer);
+    free(write_row_pointer);
+    close_read_png(read);
+    finish_write(write, options);
+}
+
+/* Adds each run of x_ratio pixels of read_row into one pixel of sums.
+   Inlined into sum_blocks_2/4/8 with a constant ratio, so the inner
+   loop is fully unrolled there. */
+static inline void sum_blocks(png_bytep read_row, uint64_t* sums, int write_width, int channels, int x_ratio)
+{
+    int x, c, i;
+    for (x=0; x < write_width; x++) {
+        png_byte* read_ptr = &(read_row[x*x_ratio*channels]);
+        for (c=0; c < channels; c++) {
+            unsigned int sum = 0;
+            for (i=0; i < x_ratio; i++) {
+                sum += read_ptr[i*channels + c];
+            }
+            sums[x*channels + c] += sum;
+        }
+    }
+}
+
+void sum_blocks_2(png_bytep read_row, uint64_t* sums, int write_width, int channels)
+{
+    sum_blocks(read_row, sums, write_width, channels, 2);
+}
+
+void sum_blocks_4(png_bytep read_row, uint64_t* sums, int write_width, int channels)
+{
+    sum_blocks(read_row, sums, write_width, channels, 4);
+}
+
+void sum_blocks_8(png_bytep read_row, uint64_t* sums, int write_width, int channels)
+{
+    sum_blocks(read_row, sums, write_width, channels, 8);
+}
+
+/* Downscaling by a whole number of pixels in each direction, for images
+   without alpha. Every input pixel then falls entirely within one
+   output pixel, so scale_png_down_no_alpha's weighted sum reduces to
+   ROUND_DIV(block sum * write area, read area), which equals
+   ROUND_DIV(block sum, block area) exactly. Blocks are summed with
+   plain adds, and for power-of-two ratios the division is a shift. */
+void scale_png_down_integer(struct png_info read, struct png_info write, struct scale_options options)
+{
+    int x, y;
+    int x_ratio = read.width / write.width;
+    int y_ratio = read.height / write.height;
+    uint64_t block_area = (uint64_t)x_ratio * y_ratio;
+    int n = write.width * write.channels;
+
+    png_bytep read_row_pointer = (png_byte*) malloc(read.rowbytes);
+    if (!read_row_pointer) {
+        abort_("Failed to allocate memory to hold one row of input PNG image");
+    }
+    uint64_t* write_row_sums_pointer = alloc_sums(write);
+    if (!write_row_sums_pointer) {
+        abort_("Failed to allocate memory - need enough to hold three rows of output PNG image");
+    }
+    png_bytep write_row_pointer = (png_byte*) malloc(write.rowbytes);
+    if (!write_row_pointer) {
+        abort_("Failed to allocate memory to hold one row of output PNG image");
+    }
+
+    memset(write_row_sums_pointer, 0, sizeof(uint64_t) * n);
+    for (y=0; y < read.height; y++) {
+        read_png_row(read, read_row_pointer);
+        switch (x_ratio) {
+        case 2:
+            sum_blocks_2(read_row_pointer, write_row_sums_pointer, write.width, write.channels);
+            break;
+        case 4:
+            sum_blocks_4(read_row_pointer, write_row_sums_pointer, write.width, write.channels);
+            break;
+        case 8:
+            sum_blocks_8(read_row_pointer, write_row_sums_pointer, write.width, write.channels);
+            break;
+        default:
+            sum_blocks(read_row_pointer, write_row_sums_pointer, write.width, write.channels, x_ratio);
+            break;
+        }
+
+        if ((y + 1) % y_ratio == 0) {
+            if (x_ratio == y_ratio && (x_ratio == 2 || x_ratio == 4 || x_ratio == 8)) {
+                int shift = x_ratio == 2 ? 2 : x_ratio == 4 ? 4 : 6;
+                for (x=0; x < n; x++) {
+                    write_row_pointer[x] = (write_row_sums_pointer[x] + (block_area >> 1)) >> shift;
                 }
-                if (fraction_in_next_col && fraction_in_next_row) {
-                    write_next_row_sums_pointer[write.channels*(write_x + 1) + c] +=
-                        value * fraction_in_next_col * fraction_in_next_row;
+            } else {
+                for (x=0; x < n; x++) {
+                    write_row_pointer[x] = ROUND_DIV(write_row_sums_pointer[x], block_area);
                 }
             }
+            write_row(write, write_row_pointer, options);
+            memset(write_row_sums_pointer, 0, sizeof(uint64_t) * n);
+        }
+    }
 
-            if (end_of_col) {
-                write_x++;
-                assert (write_x < write.width || x == read.width - 1);
+    free(read_row_pointer);
+    free(write_row_sums_pointer);
+    free(write_row_pointer);
+    close_read_png(read);
+    finish_write(write, options);
+}
+
+/* Adds the share of one input pixel that falls in output column write_x,
+   fraction_in_col being its width there in units of 1/write.width */
+void accumulate_partial_pixel(struct png_info read, struct png_info write, struct row_accumulation* acc,
+                              png_bytep read_ptr, int write_x, unsigned int fraction_in_col)
+{
+    int c;
+    for (c=0; c < write.channels; c++) {
+        uint64_t value = read_ptr[c];
+        /* Only scale_png_down, which keeps read_areas, weights by alpha;
+           scale_png_down_no_alpha divides by unweighted areas */
+        uint64_t alpha = acc->read_areas ? 255 : 1;
+        if (has_alpha_channel(read) && c < read.channels - 1) {
+            alpha = read_ptr[read.channels - 1];
+        }
+        acc->write_row_sums[write.channels*write_x + c] +=
+            value * fraction_in_col * acc->fraction_in_current_row * alpha;
+        acc->write_next_row_sums[write.channels*write_x + c] +=
+            value * fraction_in_col * acc->fraction_in_next_row * alpha;
+        if (acc->read_areas) {
+            acc->read_areas[write.channels*write_x + c] += fraction_in_col * acc->fraction_in_current_row * alpha;
+            acc->read_areas_next_row[write.channels*write_x + c] += fraction_in_col * acc->fraction_in_next_row * alpha;
+        }
+    }
+}
+
+/* Adds one input row into the sums of output columns first_col to
+   end_col - 1. Input pixels straddling the edges of that range only add
+   their share inside it, so strips of disjoint columns can be
+   accumulated in parallel and still produce exactly the sums of a
+   single pass. */
+void accumulate_row(struct png_info read, struct png_info write, struct row_accumulation* acc,
+                    int first_col, int end_col)
+{
+    int x, c;
+    png_bytep read_row_pointer = acc->read_row;
+    uint64_t* write_row_sums_pointer = acc->write_row_sums;
+    uint64_t* write_next_row_sums_pointer = acc->write_next_row_sums;
+    uint64_t* read_areas = acc->read_areas;
+    uint64_t* read_areas_next_row = acc->read_areas_next_row;
+    unsigned int fraction_in_current_row = acc->fraction_in_current_row;
+    unsigned int fraction_in_next_row = acc->fraction_in_next_row;
+
+    int first_x = (uint64_t)first_col * read.width / write.width;
+    int end_x = ((uint64_t)end_col * read.width + write.width - 1) / write.width;
+    int write_x = first_col;
+    int x_frac = 0;
+    if ((uint64_t)first_x * write.width < (uint64_t)first_col * read.width) {
+        /* First pixel straddles the previous strip */
+        x_frac = (uint64_t)(first_x + 1) * write.width - (uint64_t)first_col * read.width;
+        accumulate_partial_pixel(read, write, acc, &(read_row_pointer[first_x*read.channels]), first_col, x_frac);
+        first_x++;
+    }
+    int last_x_straddles = (uint64_t)end_x * write.width > (uint64_t)end_col * read.width;
+    if (last_x_straddles) {
+        end_x--;
+    }
+    for (x=first_x; x < end_x; x++) {
+        int end_of_col = 0;
+        unsigned int fraction_in_current_col = write.width; /* Proportion represented by integer between 0 and write.width */
+        unsigned int fraction_in_next_col = 0;
+        x_frac += write.width;
+        if (x_frac >= read.width) {
+            /* We've reached a boundary between output image columns. */
+            end_of_col = 1;
+            x_frac -= read.width;
+            fraction_in_current_col = write.width - x_frac;
+            fraction_in_next_col = x_frac;
+        }
+
+        png_byte* read_ptr = &(read_row_pointer[x*read.channels]);
+        for (c=0; c < write.channels; c++) {
+            uint64_t value = read_ptr[c];
+            uint64_t alpha = 255;
+            if (has_alpha_channel(read) && c < read.channels - 1) {
+                alpha = read_ptr[read.channels - 1];
+            }
+            write_row_sums_pointer[write.channels*write_x + c] +=
+                value * fraction_in_current_col * fraction_in_current_row * alpha;
+            read_areas[write.channels*write_x + c] += fraction_in_current_col * fraction_in_current_row * alpha;
+            if (fraction_in_next_col) {
+                write_row_sums_pointer[write.channels*(write_x + 1) + c] +=
+                    value * fraction_in_next_col * fraction_in_current_row * alpha;
+                read_areas[write.channels*(write_x + 1) + c] += fraction_in_next_col * fraction_in_current_row * alpha;
+            }
+            if (fraction_in_next_row) {
+                write_next_row_sums_pointer[write.channels*write_x + c] +=
+                    value * fraction_in_current_col * fraction_in_next_row * alpha;
+                read_areas_next_row[write.channels*write_x + c] += fraction_in_current_col * fraction_in_next_row * alpha;
+            }
+            if (fraction_in_next_col && fraction_in_next_row) {
+                write_next_row_sums_pointer[write.channels*(write_x + 1) + c] +=
+                    value * fraction_in_next_col * fraction_in_next_row * alpha;
+                read_areas_next_row[write.channels*(write_x + 1) + c] += fraction_in_next_col * fraction_in_next_row * alpha;
             }
         }
 
-        if (end_of_row) {
+        if (end_of_col) {
+            write_x++;
+            assert (write_x < write.width || x == read.width - 1);
+        }
+    }
+
+    if (last_x_straddles) {
+        /* Last pixel straddles the next strip */
+        accumulate_partial_pixel(read, write, acc, &(read_row_pointer[end_x*read.channels]), end_col - 1,
+                                 (uint64_t)end_col * read.width - (uint64_t)end_x * write.width);
+    }
+}
+
+/* As accumulate_row, for images without an alpha channel */
+void accumulate_row_no_alpha(struct png_info read, struct png_info write, struct row_accumulation* acc,
+                             int first_col, int end_col)
+{
+    int x, c;
+    png_bytep read_row_pointer = acc->read_row;
+    uint64_t* write_row_sums_pointer = acc->write_row_sums;
+    uint64_t* write_next_row_sums_pointer = acc->write_next_row_sums;
+    unsigned int fraction_in_current_row = acc->fraction_in_current_row;
+    unsigned int fraction_in_next_row = acc->fraction_in_next_row;
+
+    int first_x = (uint64_t)first_col * read.width / write.width;
+    int end_x = ((uint64_t)end_col * read.width + write.width - 1) / write.width;
+    int write_x = first_col;
+    int x_frac = 0;
+    if ((uint64_t)first_x * write.width < (uint64_t)first_col * read.width) {
+        /* First pixel straddles the previous strip */
+        x_frac = (uint64_t)(first_x + 1) * write.width - (uint64_t)first_col * read.width;
+        accumulate_partial_pixel(read, write, acc, &(read_row_pointer[first_x*read.channels]), first_col, x_frac);
+        first_x++;
+    }
+    int last_x_straddles = (uint64_t)end_x * write.width > (uint64_t)end_col * read.width;
+    if (last_x_straddles) {
+        end_x--;
+    }
+    for (x=first_x; x < end_x; x++) {
+        int end_of_col = 0;
+        unsigned int fraction_in_current_col = write.width; /* Proportion represented by integer between 0 and write.width */
+        unsigned int fraction_in_next_col = 0;
+        x_frac += write.width;
+        if (x_frac >= read.width) {
+            /* We've reached a boundary between output image columns. */
+            end_of_col = 1;
+            x_frac -= read.width;
+            fraction_in_current_col = write.width - x_frac;
+            fraction_in_next_col = x_frac;
+        }
+
+        png_byte* read_ptr = &(read_row_pointer[x*read.channels]);
+        for (c=0; c < write.channels; c++) {
+            uint64_t value = read_ptr[c];
+            write_row_sums_pointer[write.channels*write_x + c] +=
+                value * fraction_in_current_col * fraction_in_current_row;
+            if (fraction_in_next_col) {
+                write_row_sums_pointer[write.channels*(write_x + 1) + c] +=
+                    value * fraction_in_next_col * fraction_in_current_row;
+            }
+            if (fraction_in_next_row) {
+                write_next_row_sums_pointer[write.channels*write_x + c] +=
+                    value * fraction_in_current_col * fraction_in_next_row;
+            }
+            if (fraction_in_next_col && fraction_in_next_row) {
+                write_next_row_sums_pointer[write.channels*(write_x + 1) + c] +=
+                    value * fraction_in_next_col * fraction_in_next_row;
+            }
+        }
+
+        if (end_of_col) {
+            write_x++;
+            assert (write_x < write.width || x == read.width - 1);
+        }
+    }
+
+    if (last_x_straddles) {
+        /* Last pixel straddles the next strip */
+        accumulate_partial_pixel(read, write, acc, &(read_row_pointer[end_x*read.channels]), end_col - 1,
+                                 (uint64_t)end_col * read.width - (uint64_t)end_x * write.width);
+    }
+}
+
+/* Sum buffers start on a cache line, so strips never share one */
+uint64_t* alloc_sums(struct png_info write)
+{
+    void* result;
+    if (posix_memalign(&result, 64, sizeof(uint64_t) * write.width * write.channels) != 0) {
+        return NULL;
+    }
+    return (uint64_t*) result;
+}
+
+void* strip_worker_main(void* arg)
+{
+    struct strip_worker* worker = (struct strip_worker*) arg;
+    struct strip_pool* pool = worker->pool;
+    int first_col = pool->first_cols[worker->strip];
+    int end_col = pool->first_cols[worker->strip + 1];
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->quit) {
+            return NULL;
+        }
+        if (pool->acc->read_areas) {
+            accumulate_row(pool->read, pool->write, pool->acc, first_col, end_col);
+        } else {
+            accumulate_row_no_alpha(pool->read, pool->write, pool->acc, first_col, end_col);
+        }
+        pthread_barrier_wait(&pool->done);
+    }
+}
+
+/* Splits the output columns into strips, one per thread, with the
+   calling thread taking the first. Returns NULL if the image is too
+   narrow to be worth splitting. */
+struct strip_pool* start_strip_pool(struct png_info read, struct png_info write, int threads)
+{
+    int i;
+    int strips = threads;
+    if (strips > write.width / STRIP_ALIGNMENT) {
+        strips = write.width / STRIP_ALIGNMENT;
+    }
+    if (strips <= 1) {
+        return NULL;
+    }
+
+    struct strip_pool* pool = (struct strip_pool*) malloc(sizeof(struct strip_pool));
+    struct strip_worker* workers = (struct strip_worker*) malloc(sizeof(struct strip_worker) * strips);
+    if (!pool || !workers) {
+        abort_("Failed to allocate memory for %d threads", strips);
+    }
+    pool->strips = strips;
+    pool->workers = workers;
+    pool->first_cols = (int*) malloc(sizeof(int) * (strips + 1));
+    pool->threads = (pthread_t*) malloc(sizeof(pthread_t) * strips);
+    if (!pool->first_cols || !pool->threads) {
+        abort_("Failed to allocate memory for %d threads", strips);
+    }
+    for (i=0; i < strips; i++) {
+        int first_col = (uint64_t)i * write.width / strips;
+        pool->first_cols[i] = first_col - first_col % STRIP_ALIGNMENT;
+    }
+    pool->first_cols[strips] = write.width;
+    pool->read = read;
+    pool->write = write;
+    pool->acc = NULL;
+    pool->quit = 0;
+    pthread_barrier_init(&pool->start, NULL, strips);
+    pthread_barrier_init(&pool->done, NULL, strips);
+
+    for (i=1; i < strips; i++) {
+        workers[i].pool = pool;
+        workers[i].strip = i;
+        if (pthread_create(&pool->threads[i], NULL, strip_worker_main, &workers[i]) != 0) {
+            abort_("Failed to start strip thread");
+        }
+    }
+    return pool;
+}
+
+void accumulate_row_in_strips(struct strip_pool* pool, struct row_accumulation* acc)
+{
+    pool->acc = acc;
+    pthread_barrier_wait(&pool->start);
+    if (acc->read_areas) {
+        accumulate_row(pool->read, pool->write, acc, pool->first_cols[0], pool->first_cols[1]);
+    } else {
+        accumulate_row_no_alpha(pool->read, pool->write, acc, pool->first_cols[0], pool->first_cols[1]);
+    }
+    pthread_barrier_wait(&pool->done);
+}
+
+void stop_strip_pool(struct strip_pool* pool)
+{
+    int i;
+    pool->quit = 1;
+    pthread_barrier_wait(&pool->start);
+    for (i=1; i < pool->strips; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    free(pool->first_cols);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
+
+/* Shrinks a single row to write_width pixels by area averaging, using
+   the same fractional column weights as scale_png_down. sums and areas
+   are scratch buffers holding write_width*channels entries. */
+void box_filter_row(png_bytep read_row, int read_width, png_bytep write_row, int write_width,
+                    int channels, int bit_depth, uint64_t* sums, uint64_t* areas)
+{
+    int x, c;
+    int alpha_channel = (channels == 2 || channels == 4) ? channels - 1 : -1;
+
+    memset(sums, 0, sizeof(uint64_t) * write_width * channels);
+    memset(areas, 0, sizeof(uint64_t) * write_width * channels);
+    int write_x = 0;
+    int x_frac = 0;
+    for (x=0; x < read_width; x++) {
+        int end_of_col = 0;
+        unsigned int fraction_in_current_col = write_width; /* Proportion represented by integer between 0 and write_width */
+        unsigned int fraction_in_next_col = 0;
+        x_frac += write_width;
+        if (x_frac >= read_width) {
+            /* We've reached a boundary between output image columns. */
+            end_of_col = 1;
+            x_frac -= read_width;
+            fraction_in_current_col = write_width - x_frac;
+            fraction_in_next_col = x_frac;
+        }
+
+        for (c=0; c < channels; c++) {
+            uint64_t value = get_sample(read_row, x*channels + c, bit_depth);
+            uint64_t alpha = max_sample(bit_depth);
+            if (alpha_channel >= 0 && c != alpha_channel) {
+                alpha = get_sample(read_row, x*channels + alpha_channel, bit_depth);
+            }
+            sums[channels*write_x + c] += value * fraction_in_current_col * alpha;
+            areas[channels*write_x + c] += fraction_in_current_col * alpha;
+            if (fraction_in_next_col) {
+                sums[channels*(write_x + 1) + c] += value * fraction_in_next_col * alpha;
+                areas[channels*(write_x + 1) + c] += fraction_in_next_col * alpha;
+            }
+        }
+
+        if (end_of_col) {
+            write_x++;
+            assert (write_x < write_width || x == read_width - 1);
+        }
+    }
+
+    for (x=0; x < write_width * channels; x++) {
+        if (areas[x] == 0) {
+            /* Fully transparent pixel, value is irrelevant */
+            set_sample(write_row, x, bit_depth, 0);
+        } else {
+            set_sample(write_row, x, bit_depth, ROUND_DIV(sums[x], areas[x]));
+        }
+    }
+}
+
+/* Stretches a single row to write_width pixels by linear interpolation,
+   sampling at the same positions as scale_png_up but in integer
+   arithmetic. */
+void interpolate_row(png_bytep read_row, int read_width, png_bytep write_row, int write_width,
+                     int channels, int bit_depth)
+{
+    int x, c;
+
+    for (x=0; x < write_width; x++) {
+        uint64_t position = (uint64_t)x * (read_width - 1);
+        int read_x = position / write_width;
+        uint64_t fraction_from_right_col = position % write_width; /* Between 0 and write_width */
+        uint64_t fraction_from_left_col = write_width - fraction_from_right_col;
+        int read_right_x = read_x + 1 < read_width ? read_x + 1 : read_x;
+
+        for (c=0; c < channels; c++) {
+            set_sample(write_row, x*channels + c, bit_depth,
+                       ROUND_DIV(get_sample(read_row, read_x*channels + c, bit_depth) * fraction_from_left_col +
+                                 get_sample(read_row, read_right_x*channels + c, bit_depth) * fraction_from_right_col,
+                                 (uint64_t)write_width));
+        }
+    }
+}
+
+#define resample_row(read_row, read, write_row, write, sums, areas) \
+    do { \
+        if ((write).width > (read).width) { \
+            interpolate_row(read_row, (read).width, write_row, (write).width, (write).channels, (write).bit_depth); \
+        } else { \
+            box_filter_row(read_row, (read).width, write_row, (write).width, (write).channels, (write).bit_depth, \
+                           sums, areas); \
+        } \
+    } while(0)
+
+void scale_png_mixed(struct png_info read, struct png_info write, struct scale_options options)
+{
+    int x, y, c;
+
+    /* One axis grows while the other shrinks. Each input row is first
+       resampled horizontally to write.width pixels - box filtered if
+       the width shrinks, interpolated if it grows - and the resulting
+       rows are then combined vertically the other way around. Only a
+       few rows are held in memory at any time. */
+    png_bytep read_row_pointer = (png_byte*) malloc(read.rowbytes);
+    if (!read_row_pointer) {
+        abort_("Failed to allocate memory to hold one row of input PNG image");
+    }
+
+    png_bytep row_pointer = (png_byte*) malloc(write.rowbytes);
+    png_bytep next_row_pointer = (png_byte*) malloc(write.rowbytes);
+    png_bytep write_row_pointer = (png_byte*) malloc(write.rowbytes);
+    uint64_t* sums = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
+    uint64_t* areas = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
+    if (!row_pointer || !next_row_pointer || !write_row_pointer || !sums || !areas) {
+        abort_("Failed to allocate memory to hold three rows of output PNG image and the sums for one");
+    }
+
+    if (write.height > read.height) {
+        /* Interpolate vertically between the two resampled rows
+           surrounding each output row. */
+        read_png_row(read, read_row_pointer);
+        resample_row(read_row_pointer, read, row_pointer, write, sums, areas);
+        if (read.height > 1) {
+            read_png_row(read, read_row_pointer);
+            resample_row(read_row_pointer, read, next_row_pointer, write, sums, areas);
+        } else {
+            memcpy(next_row_pointer, row_pointer, write.rowbytes);
+        }
+
+        uint64_t read_y = 0;
+        for (y=0; y < write.height; y++) {
+            uint64_t position = (uint64_t)y * (read.height - 1);
+            uint64_t fraction_from_below_row = position % write.height; /* Between 0 and write.height */
+            uint64_t fraction_from_above_row = write.height - fraction_from_below_row;
+            while (read_y < position / write.height) {
+                SWAP(row_pointer, next_row_pointer, png_bytep);
+                read_png_row(read, read_row_pointer);
+                resample_row(read_row_pointer, read, next_row_pointer, write, sums, areas);
+                read_y++;
+            }
+
+            for (x=0; x < write.width * write.channels; x++) {
+                set_sample(write_row_pointer, x, write.bit_depth,
+                           ROUND_DIV(get_sample(row_pointer, x, write.bit_depth) * fraction_from_above_row +
+                                     get_sample(next_row_pointer, x, write.bit_depth) * fraction_from_below_row,
+                                     (uint64_t)write.height));
+            }
+            write_row(write, write_row_pointer, options);
+        }
+    } else {
+        /* Box filter vertically, accumulating resampled rows the same
+           way scale_png_down accumulates input pixels. */
+        uint64_t* write_row_sums_pointer = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
+        uint64_t* write_next_row_sums_pointer = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
+        uint64_t* read_areas = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
+        uint64_t* read_areas_next_row = (uint64_t*) malloc(sizeof(uint64_t) * write.width * write.channels);
+        if (!write_row_sums_pointer || !write_next_row_sums_pointer || !read_areas || !read_areas_next_row) {
+            abort_("Failed to allocate memory to hold the sums for two rows of output PNG image");
+        }
+        memset(write_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
+        memset(write_next_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
+        memset(read_areas, 0, sizeof(uint64_t) * write.width * write.channels);
+        memset(read_areas_next_row, 0, sizeof(uint64_t) * write.width * write.channels);
+
+        int y_frac = 0;
+        for (y=0; y < read.height; y++) {
+            read_png_row(read, read_row_pointer);
+            resample_row(read_row_pointer, read, row_pointer, write, sums, areas);
+
+            int end_of_row = 0;
+            unsigned int fraction_in_current_row = write.height; /* Proportion represented by integer between 0 and write.height */
+            unsigned int fraction_in_next_row = 0;
+            y_frac += write.height;
+            if (y_frac >= read.height) {
+                /* We've reached a boundary between output image rows. */
+                end_of_row = 1;
+                y_frac -= read.height;
+                fraction_in_current_row = write.height - y_frac;
+                fraction_in_next_row = y_frac;
+            }
+
             for (x=0; x < write.width; x++) {
-                png_byte* write_ptr = &(write_row_pointer[x*write.channels]);
-                uint64_t* write_sums_ptr = &(write_row_sums_pointer[x*write.channels]);
                 for (c=0; c < write.channels; c++) {
-                    write_ptr[c] = ROUND_DIV(write_sums_ptr[c], read_area);
+                    int i = write.channels*x + c;
+                    uint64_t value = get_sample(row_pointer, i, write.bit_depth);
+                    uint64_t alpha = max_sample(write.bit_depth);
+                    if (has_alpha_channel(write) && c < write.channels - 1) {
+                        alpha = get_sample(row_pointer, write.channels*x + write.channels - 1, write.bit_depth);
+                    }
+                    write_row_sums_pointer[i] += value * fraction_in_current_row * alpha;
+                    read_areas[i] += fraction_in_current_row * alpha;
+                    if (fraction_in_next_row) {
+                        write_next_row_sums_pointer[i] += value * fraction_in_next_row * alpha;
+                        read_areas_next_row[i] += fraction_in_next_row * alpha;
+                    }
                 }
             }
 
-            png_write_row(write.png_ptr, write_row_pointer);
-            SWAP(write_row_sums_pointer, write_next_row_sums_pointer, uint64_t*);
-            memset(write_next_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
+            if (end_of_row) {
+                for (x=0; x < write.width * write.channels; x++) {
+                    if (read_areas[x] == 0) {
+                        /* Fully transparent pixel, value is irrelevant */
+                        set_sample(write_row_pointer, x, write.bit_depth, 0);
+                    } else {
+                        set_sample(write_row_pointer, x, write.bit_depth,
+                                   ROUND_DIV(write_row_sums_pointer[x], read_areas[x]));
+                    }
+                }
+
+                write_row(write, write_row_pointer, options);
+                SWAP(write_row_sums_pointer, write_next_row_sums_pointer, uint64_t*);
+                memset(write_next_row_sums_pointer, 0, sizeof(uint64_t) * write.width * write.channels);
+                SWAP(read_areas, read_areas_next_row, uint64_t*);
+                memset(read_areas_next_row, 0, sizeof(uint64_t) * write.width * write.channels);
+            }
         }
+        free(write_row_sums_pointer);
+        free(write_next_row_sums_pointer);
+        free(read_areas);
+        free(read_areas_next_row);
     }
 
+    free(read_row_pointer);
+    free(row_pointer);
+    free(next_row_pointer);
+    free(write_row_pointer);
+    free(sums);
+    free(areas);
     close_read_png(read);
-    close_write_png(write);
+    finish_write(write, options);
 }
 
 struct png_info compute_write_info(struct png_info read, int width, int height)
@@ -359,31 +1589,507 @@ struct png_info compute_write_info(struct png_info read, int width, int height)
     if (write.height == 0) {
         write.height = 1;
     }
-    write.bit_depth = 8;
+    /* 8 unless the input was opened keeping 16-bit samples */
+    write.bit_depth = read.bit_depth;
     write.color_type = read.color_type & ~PNG_COLOR_MASK_PALETTE;
     return write;
 }
 
-int main(int argc, char **argv)
+enum scaler choose_scaler(struct png_info read, struct png_info write, int approximate)
+{
+    if (write.width > read.width && write.height > read.height) {
+        return SCALER_UP;
+    } else if (write.width > read.width || write.height > read.height) {
+        return SCALER_MIXED;
+    } else if (approximate && read.width / write.width >= APPROXIMATE_MIN_RATIO) {
+        return SCALER_DOWN_SAMPLED;
+    } else if (read.bit_depth == 16) {
+        return SCALER_DOWN_16;
+    } else if (!has_alpha_channel(read) &&
+               read.width % write.width == 0 && read.height % write.height == 0) {
+        return SCALER_DOWN_INTEGER;
+    } else if (!has_alpha_channel(read)) {
+        return SCALER_DOWN_NO_ALPHA;
+    } else {
+        return SCALER_DOWN;
+    }
+}
+
+/* Peak bytes allocated while scaling, mirroring the buffers allocated by
+   each scale_png_* function */
+uint64_t estimate_working_set(struct png_info read, struct png_info write, enum scaler scaler)
+{
+    uint64_t sums_bytes = sizeof(uint64_t) * write.width * write.channels;
+    switch (scaler) {
+    case SCALER_UP:
+        return 2 * (uint64_t)read.rowbytes + write.rowbytes;
+    case SCALER_MIXED:
+        return read.rowbytes + 3 * (uint64_t)write.rowbytes + 2 * sums_bytes +
+               (write.height > read.height ? 0 : 4 * sums_bytes);
+    case SCALER_DOWN_NO_ALPHA:
+        return read.rowbytes + 2 * sums_bytes + write.rowbytes;
+    case SCALER_DOWN_INTEGER:
+        return read.rowbytes + sums_bytes + write.rowbytes;
+    case SCALER_DOWN_16:
+        return read.rowbytes + 6 * sums_bytes + write.rowbytes;
+    case SCALER_DOWN_SAMPLED:
+        return read.rowbytes + 4 * sums_bytes + write.rowbytes + sizeof(int) * (write.width + 1);
+    case SCALER_DOWN:
+    default:
+        return read.rowbytes + 4 * sums_bytes + write.rowbytes;
+    }
+}
+
+/* Prints one line of JSON describing the input and the scaling pngscale
+   would do, from the file's header chunks alone. Returns 0 on success. */
+int probe(const char* read_file_name, int width, int height, int keep_16,
+          int orientation, int auto_orient, int approximate)
 {
-    if (argc != 5) {
-        printf("Usage: pngscale <input file> <output file> <width px> <height px>\n"
-               "Set either width or height to -1 to choose other to preserve aspect ratio.\n");
+    struct png_probe probe;
+    const char* error = probe_png(read_file_name, &probe);
+
+    printf("{\"file\":");
+    print_json_string(read_file_name);
+    if (error) {
+        printf(",\"error\":");
+        print_json_string(error);
+        printf("}\n");
         return 1;
     }
 
-    int width = atoi(argv[3]);
-    int height = atoi(argv[4]);
+    struct png_info read = probe_read_info(probe, keep_16);
+    orientation = compose_orientations(auto_orient ? probe.exif_orientation : 1, orientation);
+    struct png_info write = orientation_transposes(orientation) ?
+        compute_write_info(read, height, width) : compute_write_info(read, width, height);
+    write.channels = get_channels_per_pixel(write);
+    write.rowbytes = write.width * write.channels * (write.bit_depth / 8);
+    enum scaler scaler = choose_scaler(read, write, approximate);
+    int display_width = orientation_transposes(orientation) ? write.height : write.width;
+    int display_height = orientation_transposes(orientation) ? write.width : write.height;
 
-    struct png_info read = open_read_png(argv[1]);
-    struct png_info write = compute_write_info(read, width, height);
-    open_write_png(argv[2], &write);
-    if (write.width > read.width || write.height > read.height) {
-        scale_png_up(read, write);
-    } else if (!has_alpha_channel(read)) {
-        scale_png_down_no_alpha(read, write);
+    /* libpng inflates every row at the source bit depth, plus a filter
+       byte per row, whatever the output size */
+    int samples = probe.color_type == PNG_COLOR_TYPE_PALETTE ? 1 :
+                  get_channels_per_pixel((struct png_info){ .color_type = probe.color_type });
+    uint64_t source_rowbytes = ((uint64_t)probe.width * samples * probe.bit_depth + 7) / 8;
+    uint64_t decode_bytes = (uint64_t)probe.height * (source_rowbytes + 1);
+    uint64_t scale_samples = scaler == SCALER_DOWN_SAMPLED ?
+        (uint64_t)write.width * APPROXIMATE_SAMPLES * read.height * read.channels :
+        (uint64_t)read.width * read.height * read.channels;
+    /* libpng keeps the current and previous raw rows and a 32 KB zlib window */
+    uint64_t working_set = estimate_working_set(read, write, scaler) + 2 * (source_rowbytes + 1) + 32768;
+    if (orientation != 1) {
+        /* The scaled image held by start_reorientation and the band of
+           reoriented rows allocated by write_reoriented_rows */
+        working_set += (uint64_t)write.rowbytes * write.height +
+                       (uint64_t)display_width * write.channels * (write.bit_depth / 8) * TRANSPOSE_BLOCK;
+    }
+
+    printf(",\"width\":%d,\"height\":%d,\"bit_depth\":%d,\"color_type\":%d,\"interlaced\":%s,"
+           "\"palette_entries\":%d,\"trns\":%s,",
+           probe.width, probe.height, probe.bit_depth, probe.color_type,
+           probe.interlace_type == PNG_INTERLACE_ADAM7 ? "true" : "false",
+           probe.palette_entries, probe.has_trns ? "true" : "false");
+    if (probe.has_gama) {
+        printf("\"gamma\":%.5f,", probe.gama / 100000.0);
     } else {
-        scale_png_down(read, write);
+        printf("\"gamma\":null,");
+    }
+    printf("\"output\":{\"width\":%d,\"height\":%d,\"bit_depth\":%d,\"channels\":%d,\"scaler\":\"%s\","
+           "\"orientation\":%d},\"working_set_bytes\":%llu,\"decode_bytes\":%llu,\"scale_samples\":%llu}\n",
+           display_width, display_height, write.bit_depth, write.channels, scaler_names[scaler], orientation,
+           (unsigned long long)working_set, (unsigned long long)decode_bytes,
+           (unsigned long long)scale_samples);
+    return 0;
+}
+
+/* On a cache hit the input is never decoded, so the side outputs are
+   gathered from the (small) cached result instead */
+void side_outputs_from_png(const char* file_name, const char* side_outputs_file_name)
+{
+    int y;
+    struct png_info info = open_read_png(file_name);
+    struct side_outputs* side = side_outputs_start(info);
+    png_bytep row = (png_byte*) malloc(info.rowbytes);
+    if (!row) {
+        abort_("Failed to allocate memory to hold one row of output PNG image");
+    }
+    for (y=0; y < info.height; y++) {
+        read_png_row(info, row);
+        side_outputs_add_row(side, row);
+    }
+    close_read_png(info);
+    side_outputs_write(side, side_outputs_file_name);
+    free(row);
+}
+
+void* tile_worker(void* arg)
+{
+    struct tile_queue* queue = (struct tile_queue*) arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->mutex);
+        int i = queue->next++;
+        pthread_mutex_unlock(&queue->mutex);
+        if (i >= queue->count) {
+            return NULL;
+        }
+        struct tile* tile = &(queue->tiles[i]);
+        struct png_info read = open_read_png(tile->file_name);
+        int orientation = compose_orientations(queue->auto_orient ? get_exif_orientation(read) : 1,
+                                               queue->orientation);
+
+        /* Fit within the cell, preserving aspect ratio, and center */
+        int tile_width = queue->tile_width;
+        int tile_height = queue->tile_height;
+        if (orientation_transposes(orientation)) {
+            SWAP(tile_width, tile_height, int);
+        }
+        struct png_info write = compute_write_info(read, tile_width, -1);
+        if (write.height > tile_height) {
+            write = compute_write_info(read, -1, tile_height);
+        }
+        write.channels = get_channels_per_pixel(write);
+        write.rowbytes = write.width * write.channels;
+
+        struct scale_options options = { 1, NULL, tile, NULL, queue->approximate };
+        struct png_info display = write;
+        if (orientation != 1) {
+            options.reorient = start_reorientation(&write, orientation);
+            display = options.reorient->display;
+        }
+        tile->x += (queue->tile_width - display.width) / 2;
+        tile->y += (queue->tile_height - display.height) / 2;
+        tile->width = display.width;
+        tile->height = display.height;
+        scale_png(read, write, options);
+    }
+}
+
+/* Scales each input into a cell of a grid with the given number of
+   columns and writes the grid as a single RGBA image. Only one band of
+   cells is held at a time: its inputs are scaled in parallel into the
+   band's rows, which are then written out before the next band starts.
+   Prints a line of JSON giving the position of each input. */
+void make_contact_sheet(const char* write_file_name, char** read_file_names, int count,
+                        int columns, int tile_width, int tile_height, int threads,
+                        int orientation, int auto_orient, int approximate)
+{
+    int i, y, band;
+    int bands = (count + columns - 1) / columns;
+    if ((uint64_t)columns * tile_width * 4 > INT_MAX || (uint64_t)bands * tile_height > INT_MAX) {
+        abort_("Contact sheet of %dx%d tiles of %dx%dpx is too large", columns, bands, tile_width, tile_height);
+    }
+
+    struct png_info write;
+    memset(&write, 0, sizeof(write));
+    write.width = columns * tile_width;
+    write.height = bands * tile_height;
+    write.bit_depth = 8;
+    write.color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+    open_write_png(write_file_name, &write);
+
+    png_bytep band_buffer = (png_byte*) malloc((size_t)write.rowbytes * tile_height);
+    png_bytep* band_rows = (png_bytep*) malloc(sizeof(png_bytep) * tile_height);
+    struct tile* tiles = (struct tile*) malloc(sizeof(struct tile) * columns);
+    pthread_t* thread_ids = (pthread_t*) malloc(sizeof(pthread_t) * threads);
+    if (!band_buffer || !band_rows || !tiles || !thread_ids) {
+        abort_("Failed to allocate memory to hold one band of the contact sheet");
+    }
+    for (y=0; y < tile_height; y++) {
+        band_rows[y] = &(band_buffer[(size_t)y * write.rowbytes]);
+    }
+
+    struct tile_queue queue;
+    pthread_mutex_init(&queue.mutex, NULL);
+    queue.tiles = tiles;
+    queue.tile_width = tile_width;
+    queue.tile_height = tile_height;
+    queue.orientation = orientation;
+    queue.auto_orient = auto_orient;
+    queue.approximate = approximate;
+    for (band=0; band < bands; band++) {
+        /* Cells left empty stay transparent */
+        memset(band_buffer, 0, (size_t)write.rowbytes * tile_height);
+        queue.count = count - band * columns < columns ? count - band * columns : columns;
+        queue.next = 0;
+        for (i=0; i < queue.count; i++) {
+            struct tile tile = { read_file_names[band * columns + i], band_rows, i * tile_width, 0, 0, 0, 0 };
+            tiles[i] = tile;
+        }
+
+        int band_threads = threads < queue.count ? threads : queue.count;
+        for (i=1; i < band_threads; i++) {
+            if (pthread_create(&thread_ids[i], NULL, tile_worker, &queue) != 0) {
+                abort_("Failed to start tile thread");
+            }
+        }
+        tile_worker(&queue);
+        for (i=1; i < band_threads; i++) {
+            pthread_join(thread_ids[i], NULL);
+        }
+
+        for (y=0; y < tile_height; y++) {
+            png_write_row(write.png_ptr, band_rows[y]);
+        }
+        for (i=0; i < queue.count; i++) {
+            printf("{\"file\":");
+            print_json_string(tiles[i].file_name);
+            printf(",\"x\":%d,\"y\":%d,\"width\":%d,\"height\":%d}\n",
+                   tiles[i].x, band * tile_height + tiles[i].y, tiles[i].width, tiles[i].height);
+        }
+    }
+
+    pthread_mutex_destroy(&queue.mutex);
+    free(band_buffer);
+    free(band_rows);
+    free(tiles);
+    free(thread_ids);
+    close_write_png(write);
+}
+
+void usage(void)
+{
+    printf("Usage: pngscale [options] <input file> <output file> <width px> <height px>\n"
+           "       pngscale --cache-dir <dir> --cache-stats\n"
+           "       pngscale --probe <input file>... <width px> <height px>\n"
+           "       pngscale --sheet <columns> <output file> <input file>... <tile width px> <tile height px>\n"
+           "Set either width or height to -1 to choose other to preserve aspect ratio.\n"
+           "\n"
+           "Options:\n"
+           "  --cache-dir <dir>     Reuse results of identical earlier requests stored in <dir>\n"
+           "  --cache-max-mb <n>    Evict least recently used results beyond <n> MB (default %d)\n"
+           "  --cache-stats         Print JSON statistics for the cache directory and exit\n"
+           "  --threads <n>         Split each row of a downscaled image into <n> column strips\n"
+           "                        accumulated in parallel; only worthwhile for very wide images\n"
+           "  --tail                Start scaling while the input file is still being written,\n"
+           "                        or read it from a pipe (\"-\" for standard input)\n"
+           "  --tail-timeout <sec>  With --tail, give up if no data arrives for <sec> seconds\n"
+           "                        (default %d)\n"
+           "  --tail-done <file>    With --tail, the writer creates <file> when it has finished\n"
+           "  --16-bit              Keep 16 bits per sample through scaling for 16-bit inputs,\n"
+           "                        instead of reducing them to 8 bits first\n"
+           "  --side-outputs <file> Also write the average color, a tiny placeholder image and a\n"
+           "                        perceptual hash of the output to <file> as JSON\n"
+           "  --sheet <columns>     Scale each input into a cell of a grid with <columns> columns,\n"
+           "                        written as one RGBA image; prints the position of each input.\n"
+           "                        --threads sets how many inputs are scaled at once (default:\n"
+           "                        one per processor)\n"
+           "  --rotate <degrees>    Rotate the output clockwise by 90, 180 or 270 degrees\n"
+           "  --flip <direction>    Mirror the output horizontally or vertically; --rotate and\n"
+           "                        --flip are applied in the order given\n"
+           "  --auto-orient         Apply the orientation in the input's eXIf chunk before any\n"
+           "                        --rotate or --flip\n"
+           "  --approximate         When shrinking the width %d times or more, average a sample\n"
+           "                        of %d input columns per output pixel instead of all of them\n"
+           "  --probe               Print a line of JSON per input describing it and the scaling\n"
+           "                        that would be done, reading only its header chunks\n",
+           DEFAULT_CACHE_MAX_MB, DEFAULT_TAIL_TIMEOUT, APPROXIMATE_MIN_RATIO, APPROXIMATE_SAMPLES);
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"cache-dir",    required_argument, NULL, 'c'},
+        {"cache-max-mb", required_argument, NULL, 'm'},
+        {"cache-stats",  no_argument,       NULL, 's'},
+        {"probe",        no_argument,       NULL, 'p'},
+        {"threads",      required_argument, NULL, 't'},
+        {"tail",         no_argument,       NULL, 'f'},
+        {"tail-timeout", required_argument, NULL, 'o'},
+        {"tail-done",    required_argument, NULL, 'e'},
+        {"side-outputs", required_argument, NULL, 'j'},
+        {"16-bit",       no_argument,       NULL, 'b'},
+        {"sheet",        required_argument, NULL, 'g'},
+        {"rotate",       required_argument, NULL, 'r'},
+        {"flip",         required_argument, NULL, 'l'},
+        {"auto-orient",  no_argument,       NULL, 'a'},
+        {"approximate",  no_argument,       NULL, 'x'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* cache_dir = NULL;
+    uint64_t cache_max_bytes = (uint64_t)DEFAULT_CACHE_MAX_MB << 20;
+    int cache_stats = 0;
+    int probe_mode = 0;
+    struct scale_options options = { 1, NULL, NULL, NULL, 0 };
+    int tail = 0;
+    int tail_timeout = DEFAULT_TAIL_TIMEOUT;
+    const char* tail_done_file_name = NULL;
+    const char* side_outputs_file_name = NULL;
+    int keep_16 = 0;
+    int sheet_columns = 0;
+    int threads_given = 0;
+    int orientation = 1;
+    int auto_orient = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "+", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            cache_dir = optarg;
+            break;
+        case 'm':
+            cache_max_bytes = (uint64_t)strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 's':
+            cache_stats = 1;
+            break;
+        case 'p':
+            probe_mode = 1;
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            threads_given = 1;
+            break;
+        case 'f':
+            tail = 1;
+            break;
+        case 'o':
+            tail_timeout = atoi(optarg);
+            break;
+        case 'e':
+            tail_done_file_name = optarg;
+            break;
+        case 'j':
+            side_outputs_file_name = optarg;
+            break;
+        case 'b':
+            keep_16 = 1;
+            break;
+        case 'g':
+            sheet_columns = atoi(optarg);
+            break;
+        case 'r':
+            if (strcmp(optarg, "90") == 0) {
+                orientation = compose_orientations(orientation, 6);
+            } else if (strcmp(optarg, "180") == 0) {
+                orientation = compose_orientations(orientation, 3);
+            } else if (strcmp(optarg, "270") == 0) {
+                orientation = compose_orientations(orientation, 8);
+            } else if (strcmp(optarg, "0") != 0) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'l':
+            if (strcmp(optarg, "horizontal") == 0) {
+                orientation = compose_orientations(orientation, 2);
+            } else if (strcmp(optarg, "vertical") == 0) {
+                orientation = compose_orientations(orientation, 4);
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'a':
+            auto_orient = 1;
+            break;
+        case 'x':
+            options.approximate = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (cache_stats) {
+        if (!cache_dir || optind != argc) {
+            usage();
+            return 1;
+        }
+        cache_print_stats(cache_dir, cache_max_bytes);
+        return 0;
+    }
+
+    if (probe_mode) {
+        int i;
+        int result = 0;
+        if (argc - optind < 3) {
+            usage();
+            return 1;
+        }
+        int width = atoi(argv[argc - 2]);
+        int height = atoi(argv[argc - 1]);
+        if (!((width > 0 || width == -1) && (height > 0 || height == -1) && (width > 0 || height > 0))) {
+            abort_("Invalid width/height");
+        }
+        for (i = optind; i < argc - 2; i++) {
+            result |= probe(argv[i], width, height, keep_16, orientation, auto_orient, options.approximate);
+        }
+        return result;
+    }
+
+    if (sheet_columns) {
+        if (argc - optind < 4 || sheet_columns < 1 || cache_dir || tail || keep_16 || side_outputs_file_name) {
+            usage();
+            return 1;
+        }
+        int tile_width = atoi(argv[argc - 2]);
+        int tile_height = atoi(argv[argc - 1]);
+        if (tile_width <= 0 || tile_height <= 0) {
+            abort_("Invalid tile width/height");
+        }
+        int threads = threads_given ? options.threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+        make_contact_sheet(argv[optind], &argv[optind + 1], argc - optind - 3,
+                           sheet_columns, tile_width, tile_height, threads > 0 ? threads : 1,
+                           orientation, auto_orient, options.approximate);
+        return 0;
+    }
+
+    if (argc - optind != 4) {
+        usage();
+        return 1;
+    }
+    const char* read_file_name = argv[optind];
+    const char* write_file_name = argv[optind + 1];
+    int width = atoi(argv[optind + 2]);
+    int height = atoi(argv[optind + 3]);
+
+    if (tail && cache_dir) {
+        /* The input isn't complete, so it can't be hashed up front */
+        abort_("--tail can't be combined with --cache-dir");
+    }
+
+    char cache_key[CACHE_KEY_SIZE];
+    if (cache_dir) {
+        /* Everything besides the input bytes that affects the output */
+        char params[256];
+        snprintf(params, sizeof(params), "v%d %d %d%s o%d%s%s", CACHE_FORMAT_VERSION, width, height,
+                 keep_16 ? " 16-bit" : "", orientation, auto_orient ? " auto-orient" : "",
+                 options.approximate ? " approximate" : "");
+        cache_make_key(read_file_name, params, cache_key);
+        if (cache_lookup(cache_dir, cache_key, write_file_name)) {
+            if (side_outputs_file_name) {
+                side_outputs_from_png(write_file_name, side_outputs_file_name);
+            }
+            return 0;
+        }
+    }
+
+    struct png_info read = tail ?
+        open_read_png_progressive(read_file_name, tail_timeout, tail_done_file_name, keep_16) :
+        open_read_png_depth(read_file_name, keep_16);
+    orientation = compose_orientations(auto_orient ? get_exif_orientation(read) : 1, orientation);
+
+    /* width and height are those of the output after reorientation */
+    struct png_info write = orientation_transposes(orientation) ?
+        compute_write_info(read, height, width) : compute_write_info(read, width, height);
+    struct png_info* output = &write;
+    if (orientation != 1) {
+        options.reorient = start_reorientation(&write, orientation);
+        output = &(options.reorient->display);
+    }
+    open_write_png(write_file_name, output);
+    if (side_outputs_file_name) {
+        options.side = side_outputs_start(*output);
+    }
+    scale_png(read, write, options);
+
+    if (options.side) {
+        side_outputs_write(options.side, side_outputs_file_name);
+    }
+    if (cache_dir) {
+        cache_insert(cache_dir, cache_key, write_file_name, cache_max_bytes);
     }
 
     return 0;
@@ -0,0 +1,394 @@
+/* Copyright (c) 2011 Derrick Coetzee, Guillaume Cottenceau, and contributors
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Based on code distributed by Guillaume Cottenceau and contributors
+under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
+*/
+
+#include "side_outputs.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Side outputs are gathered from the output rows as the scaler writes
+   them, so they cost one pass over the (small) output image rather than
+   another decode of the input. Each output pixel is added to the cells
+   of two coarse grids: one for the placeholder image and a 9x8 one for
+   the difference hash. Colors are weighted by alpha, as in the scalers,
+   so fully transparent pixels don't darken the averages. */
+
+#define PLACEHOLDER_SIZE 16
+#define HASH_WIDTH 9
+#define HASH_HEIGHT 8
+
+#define ROUND_DIV(x,y) (((x) + (y)/2)/(y))
+
+/* Per cell: red, green, blue (each multiplied by alpha), alpha, pixels */
+#define CELL_SUMS 5
+
+struct grid
+{
+    int width;
+    int height;
+    int* first_cell_x; /* cells containing each output column: [first, end) */
+    int* end_cell_x;
+    int* first_cell_y;
+    int* end_cell_y;
+    uint64_t* row_sums; /* the current output row, per column of cells */
+    uint64_t* sums;
+};
+
+struct side_outputs
+{
+    int width;
+    int height;
+    int channels;
+    int color_type;
+    int bit_depth;
+    int y;
+    uint64_t totals[CELL_SUMS];
+    struct grid placeholder;
+    struct grid hash;
+};
+
+struct memory_buffer
+{
+    png_bytep data;
+    size_t size;
+    size_t capacity;
+};
+
+static void map_cells(int pixels, int cells, int** first_cell, int** end_cell);
+static void init_grid(struct grid* grid, int width, int height, struct side_outputs* side);
+static inline void pixel_values(struct side_outputs* side, png_bytep row, int x, uint64_t* values);
+static inline void add_pixel_to_row(struct grid* grid, int x, const uint64_t* values);
+static void add_row_to_grid(struct grid* grid, int y);
+static void cell_color(const uint64_t* sums, int* color);
+static void write_to_memory(png_structp png_ptr, png_bytep data, png_size_t length);
+static void flush_memory(png_structp png_ptr);
+static struct memory_buffer encode_placeholder(struct side_outputs* side);
+static void print_base64(FILE* fp, const png_byte* data, size_t size);
+static uint64_t difference_hash(struct side_outputs* side);
+
+/* Cell i covers output pixels [i*pixels/cells, (i+1)*pixels/cells), and
+   at least one pixel when there are more cells than pixels */
+void map_cells(int pixels, int cells, int** first_cell, int** end_cell)
+{
+    int i, x;
+    *first_cell = (int*) malloc(sizeof(int) * pixels);
+    *end_cell = (int*) malloc(sizeof(int) * pixels);
+    if (!*first_cell || !*end_cell) {
+        abort_("Failed to allocate memory for side outputs");
+    }
+    for (x=0; x < pixels; x++) {
+        (*first_cell)[x] = -1;
+    }
+    for (i=0; i < cells; i++) {
+        int first_x = (int64_t)i * pixels / cells;
+        int end_x = (int64_t)(i + 1) * pixels / cells;
+        if (end_x <= first_x) {
+            end_x = first_x + 1;
+        }
+        for (x=first_x; x < end_x; x++) {
+            if ((*first_cell)[x] < 0) {
+                (*first_cell)[x] = i;
+            }
+            (*end_cell)[x] = i + 1;
+        }
+    }
+}
+
+void init_grid(struct grid* grid, int width, int height, struct side_outputs* side)
+{
+    grid->width = width;
+    grid->height = height;
+    map_cells(side->width, width, &grid->first_cell_x, &grid->end_cell_x);
+    map_cells(side->height, height, &grid->first_cell_y, &grid->end_cell_y);
+    grid->row_sums = (uint64_t*) calloc((size_t)width * CELL_SUMS, sizeof(uint64_t));
+    grid->sums = (uint64_t*) calloc((size_t)width * height * CELL_SUMS, sizeof(uint64_t));
+    if (!grid->row_sums || !grid->sums) {
+        abort_("Failed to allocate memory for side outputs");
+    }
+}
+
+struct side_outputs* side_outputs_start(struct png_info write)
+{
+    struct side_outputs* side = (struct side_outputs*) calloc(1, sizeof(struct side_outputs));
+    if (!side) {
+        abort_("Failed to allocate memory for side outputs");
+    }
+    side->width = write.width;
+    side->height = write.height;
+    side->channels = write.channels;
+    side->color_type = write.color_type;
+    side->bit_depth = write.bit_depth;
+
+    /* The placeholder keeps the output's aspect ratio */
+    int placeholder_width, placeholder_height;
+    if (write.width >= write.height) {
+        placeholder_width = write.width < PLACEHOLDER_SIZE ? write.width : PLACEHOLDER_SIZE;
+        placeholder_height = ROUND_DIV((uint64_t)placeholder_width * write.height, write.width);
+    } else {
+        placeholder_height = write.height < PLACEHOLDER_SIZE ? write.height : PLACEHOLDER_SIZE;
+        placeholder_width = ROUND_DIV((uint64_t)placeholder_height * write.width, write.height);
+    }
+    if (placeholder_width == 0) {
+        placeholder_width = 1;
+    }
+    if (placeholder_height == 0) {
+        placeholder_height = 1;
+    }
+    init_grid(&side->placeholder, placeholder_width, placeholder_height, side);
+    init_grid(&side->hash, HASH_WIDTH, HASH_HEIGHT, side);
+    return side;
+}
+
+/* Samples of 16-bit rows are reduced to 8 bits the way png_set_strip_16
+   does, so the results match those computed from an 8-bit output */
+static inline void pixel_values(struct side_outputs* side, png_bytep row, int x, uint64_t* values)
+{
+    uint64_t samples[4];
+    int c;
+    for (c=0; c < side->channels; c++) {
+        if (side->bit_depth == 16) {
+            samples[c] = ((uint16_t*)row)[x*side->channels + c] >> 8;
+        } else {
+            samples[c] = row[x*side->channels + c];
+        }
+    }
+    uint64_t alpha = 255;
+    if (side->color_type & PNG_COLOR_MASK_ALPHA) {
+        alpha = samples[side->channels - 1];
+    }
+    if (side->color_type & PNG_COLOR_MASK_COLOR) {
+        values[0] = samples[0] * alpha;
+        values[1] = samples[1] * alpha;
+        values[2] = samples[2] * alpha;
+    } else {
+        values[0] = values[1] = values[2] = samples[0] * alpha;
+    }
+    values[3] = alpha;
+    values[4] = 1;
+}
+
+static inline void add_pixel_to_row(struct grid* grid, int x, const uint64_t* values)
+{
+    int i, c;
+    for (i=grid->first_cell_x[x]; i < grid->end_cell_x[x]; i++) {
+        for (c=0; c < CELL_SUMS; c++) {
+            grid->row_sums[i*CELL_SUMS + c] += values[c];
+        }
+    }
+}
+
+void add_row_to_grid(struct grid* grid, int y)
+{
+    int i, j;
+    for (j=grid->first_cell_y[y]; j < grid->end_cell_y[y]; j++) {
+        uint64_t* cell_row = &(grid->sums[(size_t)j * grid->width * CELL_SUMS]);
+        for (i=0; i < grid->width * CELL_SUMS; i++) {
+            cell_row[i] += grid->row_sums[i];
+        }
+    }
+    memset(grid->row_sums, 0, sizeof(uint64_t) * grid->width * CELL_SUMS);
+}
+
+void side_outputs_add_row(struct side_outputs* side, png_bytep row)
+{
+    int x, c;
+    uint64_t values[CELL_SUMS];
+
+    for (x=0; x < side->width; x++) {
+        pixel_values(side, row, x, values);
+        for (c=0; c < CELL_SUMS; c++) {
+            side->totals[c] += values[c];
+        }
+        add_pixel_to_row(&side->placeholder, x, values);
+        add_pixel_to_row(&side->hash, x, values);
+    }
+    add_row_to_grid(&side->placeholder, side->y);
+    add_row_to_grid(&side->hash, side->y);
+    side->y++;
+}
+
+/* Unpremultiplied red, green, blue and mean alpha of a cell */
+void cell_color(const uint64_t* sums, int* color)
+{
+    int c;
+    if (sums[3] == 0) {
+        /* Fully transparent, color is irrelevant */
+        color[0] = color[1] = color[2] = color[3] = 0;
+        return;
+    }
+    for (c=0; c < 3; c++) {
+        color[c] = ROUND_DIV(sums[c], sums[3]);
+    }
+    color[3] = ROUND_DIV(sums[3], sums[4]);
+}
+
+void write_to_memory(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    struct memory_buffer* buffer = (struct memory_buffer*) png_get_io_ptr(png_ptr);
+    if (buffer->size + length > buffer->capacity) {
+        size_t capacity = 2 * (buffer->size + length);
+        png_bytep grown = (png_bytep) realloc(buffer->data, capacity);
+        if (!grown) {
+            png_error(png_ptr, "Failed to allocate memory for placeholder image");
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, length);
+    buffer->size += length;
+}
+
+void flush_memory(png_structp png_ptr)
+{
+}
+
+struct memory_buffer encode_placeholder(struct side_outputs* side)
+{
+    struct grid* grid = &side->placeholder;
+    struct memory_buffer buffer = { NULL, 0, 0 };
+    int x, y, c;
+    int color[4];
+
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) {
+        abort_("png_create_write_struct failed while encoding placeholder image");
+    }
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+        abort_("png_create_info_struct failed while encoding placeholder image");
+    }
+    png_bytep row = (png_bytep) malloc((size_t)grid->width * side->channels);
+    if (!row) {
+        abort_("Failed to allocate memory for placeholder image");
+    }
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        abort_("Error while encoding placeholder image");
+    }
+
+    png_set_write_fn(png_ptr, &buffer, write_to_memory, flush_memory);
+    png_set_compression_level(png_ptr, 9);
+    png_set_IHDR(png_ptr, info_ptr, grid->width, grid->height, 8, side->color_type,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_write_info(png_ptr, info_ptr);
+    for (y=0; y < grid->height; y++) {
+        for (x=0; x < grid->width; x++) {
+            png_bytep pixel = &(row[x*side->channels]);
+            cell_color(&(grid->sums[((size_t)y * grid->width + x) * CELL_SUMS]), color);
+            if (side->color_type & PNG_COLOR_MASK_COLOR) {
+                for (c=0; c < 3; c++) {
+                    pixel[c] = color[c];
+                }
+            } else {
+                pixel[0] = color[0];
+            }
+            if (side->color_type & PNG_COLOR_MASK_ALPHA) {
+                pixel[side->channels - 1] = color[3];
+            }
+        }
+        png_write_row(png_ptr, row);
+    }
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(row);
+    return buffer;
+}
+
+void print_base64(FILE* fp, const png_byte* data, size_t size)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+    for (i=0; i + 2 < size; i += 3) {
+        uint32_t bits = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | data[i + 2];
+        fprintf(fp, "%c%c%c%c", digits[bits >> 18], digits[(bits >> 12) & 63],
+                digits[(bits >> 6) & 63], digits[bits & 63]);
+    }
+    if (size - i == 1) {
+        uint32_t bits = (uint32_t)data[i] << 16;
+        fprintf(fp, "%c%c==", digits[bits >> 18], digits[(bits >> 12) & 63]);
+    } else if (size - i == 2) {
+        uint32_t bits = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8);
+        fprintf(fp, "%c%c%c=", digits[bits >> 18], digits[(bits >> 12) & 63], digits[(bits >> 6) & 63]);
+    }
+}
+
+/* 64-bit dHash: one bit per horizontally adjacent pair of cells in the
+   9x8 grid, set when the left cell is brighter. Luminance is taken over
+   black, so transparent regions hash as dark. */
+uint64_t difference_hash(struct side_outputs* side)
+{
+    struct grid* grid = &side->hash;
+    uint64_t luminance[HASH_WIDTH * HASH_HEIGHT];
+    uint64_t hash = 0;
+    int x, y;
+
+    for (y=0; y < HASH_HEIGHT; y++) {
+        for (x=0; x < HASH_WIDTH; x++) {
+            const uint64_t* sums = &(grid->sums[(y * HASH_WIDTH + x) * CELL_SUMS]);
+            luminance[y * HASH_WIDTH + x] = (299 * sums[0] + 587 * sums[1] + 114 * sums[2]) / sums[4];
+        }
+    }
+    for (y=0; y < HASH_HEIGHT; y++) {
+        for (x=0; x < HASH_WIDTH - 1; x++) {
+            hash = (hash << 1) | (luminance[y * HASH_WIDTH + x] > luminance[y * HASH_WIDTH + x + 1]);
+        }
+    }
+    return hash;
+}
+
+void side_outputs_write(struct side_outputs* side, const char* file_name)
+{
+    int color[4];
+
+    if (side->y != side->height) {
+        abort_("Side outputs saw %d of %d output rows", side->y, side->height);
+    }
+    FILE* fp = fopen(file_name, "w");
+    if (!fp) {
+        abort_("File %s could not be opened for writing", file_name);
+    }
+
+    cell_color(side->totals, color);
+    fprintf(fp, "{\"width\":%d,\"height\":%d,\"average_color\":\"#%02x%02x%02x",
+            side->width, side->height, color[0], color[1], color[2]);
+    if (side->color_type & PNG_COLOR_MASK_ALPHA) {
+        fprintf(fp, "%02x", color[3]);
+    }
+    fprintf(fp, "\"");
+
+    struct memory_buffer placeholder = encode_placeholder(side);
+    fprintf(fp, ",\"placeholder\":{\"width\":%d,\"height\":%d,\"data_uri\":\"data:image/png;base64,",
+            side->placeholder.width, side->placeholder.height);
+    print_base64(fp, placeholder.data, placeholder.size);
+    fprintf(fp, "\"}");
+    free(placeholder.data);
+
+    fprintf(fp, ",\"dhash\":\"%016llx\"}\n", (unsigned long long) difference_hash(side));
+    if (fclose(fp) != 0) {
+        abort_("Error while writing %s", file_name);
+    }
+}
@@ -27,5 +27,6 @@ under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
 #define _PNGCOMPARE_H_
 
 double png_compare(const char* filename_1, const char* filename_2);
+double png_compare_16(const char* filename_1, const char* filename_2);
 
 #endif /* #ifndef _PNGCOMPARE_H_ */
@@ -24,14 +24,18 @@ under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
 */
 
 #include "pngcompare.h"
+#include "../png_utils.h"
 #include "../utils.h"
 
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #define TEMP_DIR  "/tmp"
+#define CACHE_DIR TEMP_DIR "/pngscale.cache"
 
 int sys(const char* command) {
     time_t start_time = time(NULL);
@@ -92,6 +96,569 @@ void test_upscale(const char* filename, int downscale_width, int upscale_width,
     unlink(TEMP_DIR "/out.pngscale.upscale.png");
 }
 
+void test_mixed(const char* filename, int width, int height, double max_error) {
+    printf("Testing %s at %dx%dpx...", filename, width, height);
+    fflush(stdout);
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.png %d %d", filename, width, height);
+    int pngscale_time = sys(buffer);
+    /* Requires ImageMagick convert; '!' ignores the aspect ratio */
+    snprintf(buffer, sizeof(buffer), "convert %s -resize %dx%d! " TEMP_DIR "/out.convert.png", filename, width, height);
+    int convert_time = sys(buffer);
+    assert_png_approx_equal(TEMP_DIR "/out.pngscale.png", TEMP_DIR "/out.convert.png", max_error);
+    printf("pngscale: %d sec, convert: %d sec\n", pngscale_time, convert_time);
+    unlink(TEMP_DIR "/out.pngscale.png");
+    unlink(TEMP_DIR "/out.convert.png");
+}
+
+long long file_size(const char* filename) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        abort_("Could not stat %s", filename);
+    }
+    return st.st_size;
+}
+
+/* The entry count and total size reported by --cache-stats */
+void read_cache_stats(int* entries, long long* bytes) {
+    char line[1024];
+    FILE* fp = popen("./pngscale --cache-dir " CACHE_DIR " --cache-stats", "r");
+    if (!fp || !fgets(line, sizeof(line), fp) || pclose(fp) != 0) {
+        abort_("Could not read cache stats");
+    }
+    if (sscanf(line, "{\"entries\":%d,\"bytes\":%lld,\"max_bytes\":", entries, bytes) != 2) {
+        abort_("Could not parse cache stats '%s'", line);
+    }
+}
+
+void assert_cache_stats(int expected_entries, long long expected_bytes) {
+    int entries;
+    long long bytes;
+    read_cache_stats(&entries, &bytes);
+    if (entries != expected_entries || bytes != expected_bytes) {
+        abort_("Cache holds %d entries of %lld bytes, expected %d of %lld",
+               entries, bytes, expected_entries, expected_bytes);
+    }
+}
+
+/* Runs command on the cache entry with the same bytes as filename.
+   Returns nonzero if there is no such entry. */
+int with_cache_entry(const char* filename, const char* command) {
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer), "for f in " CACHE_DIR "/*.png; do if cmp -s %s $f; then %s $f; exit; fi; done; exit 1",
+             filename, command);
+    return system(buffer);
+}
+
+void test_cache(const char* filename, int max_width) {
+    printf("Testing result cache with %s at %dpx...", filename, max_width);
+    fflush(stdout);
+    char buffer[256];
+    sys("rm -rf " CACHE_DIR);
+    snprintf(buffer, sizeof(buffer), "./pngscale --cache-dir " CACHE_DIR " %s " TEMP_DIR "/out.pngscale.png %d -1", filename, max_width);
+    int miss_time = sys(buffer);
+    assert_cache_stats(1, file_size(TEMP_DIR "/out.pngscale.png"));
+    snprintf(buffer, sizeof(buffer), "./pngscale --cache-dir " CACHE_DIR " %s " TEMP_DIR "/out.pngscale.cached.png %d -1", filename, max_width);
+    int hit_time = sys(buffer);
+    sys("cmp -s " TEMP_DIR "/out.pngscale.png " TEMP_DIR "/out.pngscale.cached.png");
+    printf("miss: %d sec, hit: %d sec\n", miss_time, hit_time);
+
+    /* A rescaled output can't match a replaced entry, so only a hit can */
+    snprintf(buffer, sizeof(buffer), "cp %s " CACHE_DIR "/*.png", filename);
+    sys(buffer);
+    snprintf(buffer, sizeof(buffer), "./pngscale --cache-dir " CACHE_DIR " %s " TEMP_DIR "/out.pngscale.cached.png %d -1", filename, max_width);
+    sys(buffer);
+    snprintf(buffer, sizeof(buffer), "cmp -s %s " TEMP_DIR "/out.pngscale.cached.png", filename);
+    sys(buffer);
+    assert_cache_stats(1, file_size(filename));
+
+    unlink(TEMP_DIR "/out.pngscale.png");
+    unlink(TEMP_DIR "/out.pngscale.cached.png");
+    sys("rm -rf " CACHE_DIR);
+}
+
+/* Fills a 1 MB cache with filename scaled to width, width + 1 and
+   width + 2, whose entries must each be over a third of a megabyte */
+void test_cache_eviction(const char* filename, int width) {
+    printf("Testing cache eviction with %s at %dpx...\n", filename, width);
+    char buffer[1024];
+    char output[3][64];
+    long long sizes[3];
+    int i;
+    sys("rm -rf " CACHE_DIR);
+    for (i=0; i < 3; i++) {
+        snprintf(output[i], sizeof(output[i]), TEMP_DIR "/out.cache.%d.png", i);
+        if (i == 2) {
+            /* Entry 0 is older than entry 1, but a hit makes it the most
+               recently used */
+            with_cache_entry(output[0], "touch -t 200001010000");
+            with_cache_entry(output[1], "touch -t 200101010000");
+            snprintf(buffer, sizeof(buffer), "./pngscale --cache-dir " CACHE_DIR " --cache-max-mb 1 %s %s %d -1", filename, output[0], width);
+            sys(buffer);
+            assert_cache_stats(2, sizes[0] + sizes[1]);
+        }
+        snprintf(buffer, sizeof(buffer), "./pngscale --cache-dir " CACHE_DIR " --cache-max-mb 1 %s %s %d -1", filename, output[i], width + i);
+        sys(buffer);
+        sizes[i] = file_size(output[i]);
+    }
+    if (sizes[0] + sizes[1] + sizes[2] <= 1 << 20 || sizes[0] + sizes[2] > (1 << 20) / 100 * 90) {
+        abort_("Entries of %lld, %lld and %lld bytes don't test eviction from a 1 MB cache", sizes[0], sizes[1], sizes[2]);
+    }
+    /* Only the least recently used entry is evicted */
+    if (with_cache_entry(output[1], "true") == 0 || with_cache_entry(output[0], "true") != 0 ||
+        with_cache_entry(output[2], "true") != 0) {
+        abort_("Cache did not evict only its least recently used entry");
+    }
+    assert_cache_stats(2, sizes[0] + sizes[2]);
+
+    /* Lookups must survive entries being evicted by concurrent inserts */
+    for (i=0; i < 2; i++) {
+        snprintf(buffer, sizeof(buffer),
+                 "pids=; for w in $(seq %d %d); do "
+                 "./pngscale --cache-dir " CACHE_DIR " --cache-max-mb 1 %s " TEMP_DIR "/out.cache.$w.%d.png $w -1 & pids=\"$pids $!\"; "
+                 "done; for p in $pids; do wait $p || exit 1; done", width, width + 7, filename, i);
+        sys(buffer);
+    }
+    snprintf(buffer, sizeof(buffer),
+             "for w in $(seq %d %d); do cmp -s " TEMP_DIR "/out.cache.$w.0.png " TEMP_DIR "/out.cache.$w.1.png || exit 1; done",
+             width, width + 7);
+    sys(buffer);
+
+    for (i=0; i < 3; i++) {
+        unlink(output[i]);
+    }
+    sys("rm -f " TEMP_DIR "/out.cache.*.png");
+    sys("rm -rf " CACHE_DIR);
+}
+
+void test_probe(const char* options, const char* filename, int width, int height) {
+    printf("Testing probe of %s at %dx%dpx%s%s...\n", filename, width, height, *options ? " with " : "", options);
+    char buffer[256];
+    char line[1024];
+    int probe_width, probe_height;
+    snprintf(buffer, sizeof(buffer), "./pngscale --probe %s %s %d %d", options, filename, width, height);
+    FILE* fp = popen(buffer, "r");
+    if (!fp || !fgets(line, sizeof(line), fp) || pclose(fp) != 0) {
+        abort_("Command '%s' failed", buffer);
+    }
+    char* output = strstr(line, "\"output\":");
+    if (!output || sscanf(output, "\"output\":{\"width\":%d,\"height\":%d", &probe_width, &probe_height) != 2) {
+        abort_("Could not parse probe output '%s'", line);
+    }
+
+    snprintf(buffer, sizeof(buffer), "./pngscale %s %s " TEMP_DIR "/out.pngscale.png %d %d", options, filename, width, height);
+    sys(buffer);
+    struct png_info scaled = open_read_png(TEMP_DIR "/out.pngscale.png");
+    if (scaled.width != probe_width || scaled.height != probe_height) {
+        abort_("Probe predicted %dx%d but pngscale produced %dx%d", probe_width, probe_height, scaled.width, scaled.height);
+    }
+    fclose(scaled.fp);
+    unlink(TEMP_DIR "/out.pngscale.png");
+}
+
+/* A chunk length beyond 2^31 - 1 after the IHDR of filename must be
+   reported, not skipped */
+void test_probe_invalid_length(const char* filename) {
+    printf("Testing probe of an invalid chunk length after %s...\n", filename);
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer), "(head -c 33 %s; printf '\\377\\377\\377\\374tEXt') > " TEMP_DIR "/out.badlength.png", filename);
+    sys(buffer);
+    if (system("./pngscale --probe " TEMP_DIR "/out.badlength.png 100 -1 | grep -q '\"error\":\"invalid chunk length\"'") != 0) {
+        abort_("Probe did not report an invalid chunk length");
+    }
+    unlink(TEMP_DIR "/out.badlength.png");
+}
+
+void test_pngcompare(const char* filename) {
+    printf("Testing pngcompare thresholds with %s...\n", filename);
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.png 220 -1", filename);
+    sys(buffer);
+    snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.2.png 221 -1", filename);
+    sys(buffer);
+    sys("./pngscale " TEMP_DIR "/out.pngscale.2.png " TEMP_DIR "/out.pngscale.3.png 220 -1");
+    /* Identical images pass any threshold */
+    sys("./pngcompare --min-ssim 1.0 --max-distance 0 " TEMP_DIR "/out.pngscale.png " TEMP_DIR "/out.pngscale.png > /dev/null");
+    /* Rescaling changes some pixels */
+    if (system("./pngcompare --min-ssim 1.0 " TEMP_DIR "/out.pngscale.png " TEMP_DIR "/out.pngscale.3.png > /dev/null") == 0) {
+        abort_("pngcompare did not fail a pair below the SSIM threshold");
+    }
+    sys("./pngcompare --min-ssim 0.9 --min-psnr 25 " TEMP_DIR "/out.pngscale.png " TEMP_DIR "/out.pngscale.3.png > /dev/null");
+    /* A pair that can't be read is reported without stopping the batch,
+       including one whose image data is cut short */
+    sys("head -c $(( $(wc -c < " TEMP_DIR "/out.pngscale.png) / 2 )) " TEMP_DIR "/out.pngscale.png > " TEMP_DIR "/out.truncated.png");
+    int status = system("./pngcompare --jobs 2 " TEMP_DIR "/out.pngscale.png " TEMP_DIR "/out.pngscale.png "
+                        TEMP_DIR "/out.pngscale.png " TEMP_DIR "/out.missing.png "
+                        "README " TEMP_DIR "/out.pngscale.png "
+                        TEMP_DIR "/out.truncated.png " TEMP_DIR "/out.pngscale.png | grep -c '\"error\"' | grep -q '^3$'");
+    if (status != 0) {
+        abort_("pngcompare did not report unreadable pairs as errors");
+    }
+    if (system("./pngcompare " TEMP_DIR "/out.pngscale.png " TEMP_DIR "/out.missing.png > /dev/null") != 2 << 8) {
+        abort_("pngcompare did not exit with status 2 for an unreadable pair");
+    }
+    unlink(TEMP_DIR "/out.pngscale.png");
+    unlink(TEMP_DIR "/out.pngscale.2.png");
+    unlink(TEMP_DIR "/out.pngscale.3.png");
+    unlink(TEMP_DIR "/out.truncated.png");
+}
+
+void test_threads(const char* filename, int wide_width, int max_width, int threads) {
+    printf("Testing %d column strips on %s widened to %dpx...\n", threads, filename, wide_width);
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.wide.png %d 200", filename, wide_width);
+    sys(buffer);
+    snprintf(buffer, sizeof(buffer), "./pngscale " TEMP_DIR "/out.pngscale.wide.png " TEMP_DIR "/out.pngscale.png %d -1", max_width);
+    sys(buffer);
+    snprintf(buffer, sizeof(buffer), "./pngscale --threads %d " TEMP_DIR "/out.pngscale.wide.png " TEMP_DIR "/out.pngscale.threads.png %d -1", threads, max_width);
+    sys(buffer);
+    /* Must match the single-threaded output exactly */
+    sys("cmp -s " TEMP_DIR "/out.pngscale.png " TEMP_DIR "/out.pngscale.threads.png");
+    unlink(TEMP_DIR "/out.pngscale.wide.png");
+    unlink(TEMP_DIR "/out.pngscale.png");
+    unlink(TEMP_DIR "/out.pngscale.threads.png");
+}
+
+void test_integer_ratio(const char* filename, int width, int height, int ratio, double max_error) {
+    printf("Creating %dx%d image to test reduction by %d...\n", width * ratio, height * ratio, ratio);
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.large.png %d %d", filename, width * ratio, height * ratio);
+    sys(buffer);
+    test_basic(TEMP_DIR "/out.pngscale.large.png", width, max_error);
+    unlink(TEMP_DIR "/out.pngscale.large.png");
+}
+
+void test_tail(const char* filename, int max_width) {
+    printf("Testing --tail on %s at %dpx...\n", filename, max_width);
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.png %d -1", filename, max_width);
+    sys(buffer);
+    snprintf(buffer, sizeof(buffer), "cat %s | ./pngscale --tail - " TEMP_DIR "/out.pngscale.tail.png %d -1", filename, max_width);
+    sys(buffer);
+    sys("cmp -s " TEMP_DIR "/out.pngscale.png " TEMP_DIR "/out.pngscale.tail.png");
+    unlink(TEMP_DIR "/out.pngscale.tail.png");
+
+    /* A file that is still being written, finished by a done marker */
+    unlink(TEMP_DIR "/out.pngscale.growing.done");
+    snprintf(buffer, sizeof(buffer),
+             "(head -c 4096 %s; sleep 1; tail -c +4097 %s) > " TEMP_DIR "/out.pngscale.growing.png && "
+             "touch " TEMP_DIR "/out.pngscale.growing.done & "
+             "sleep 0.2; ./pngscale --tail --tail-done " TEMP_DIR "/out.pngscale.growing.done "
+             TEMP_DIR "/out.pngscale.growing.png " TEMP_DIR "/out.pngscale.tail.png %d -1; wait",
+             filename, filename, max_width);
+    sys(buffer);
+    sys("cmp -s " TEMP_DIR "/out.pngscale.png " TEMP_DIR "/out.pngscale.tail.png");
+    unlink(TEMP_DIR "/out.pngscale.growing.png");
+    unlink(TEMP_DIR "/out.pngscale.growing.done");
+    unlink(TEMP_DIR "/out.pngscale.png");
+    unlink(TEMP_DIR "/out.pngscale.tail.png");
+}
+
+void read_side_outputs(const char* filename, int width, unsigned int* color, unsigned long long* hash) {
+    char buffer[256];
+    static char json[65536];
+    snprintf(buffer, sizeof(buffer), "./pngscale --side-outputs " TEMP_DIR "/out.pngscale.json %s " TEMP_DIR "/out.pngscale.png %d -1",
+             filename, width);
+    sys(buffer);
+    FILE* fp = fopen(TEMP_DIR "/out.pngscale.json", "r");
+    if (!fp || !fgets(json, sizeof(json), fp)) {
+        abort_("Could not read side outputs of %s", filename);
+    }
+    fclose(fp);
+    char* average = strstr(json, "\"average_color\":\"#");
+    char* hash_field = strstr(json, "\"dhash\":\"");
+    if (!average || sscanf(average, "\"average_color\":\"#%6x", color) != 1 ||
+        !hash_field || sscanf(hash_field, "\"dhash\":\"%16llx", hash) != 1 ||
+        !strstr(json, "\"data_uri\":\"data:image/png;base64,iVBORw0KGgo")) {
+        abort_("Could not parse side outputs '%s'", json);
+    }
+    unlink(TEMP_DIR "/out.pngscale.json");
+    unlink(TEMP_DIR "/out.pngscale.png");
+}
+
+void test_side_outputs(const char* filename, int width1, int width2, unsigned int expected_color) {
+    printf("Testing side outputs of %s at %dpx and %dpx...\n", filename, width1, width2);
+    unsigned int color1, color2;
+    unsigned long long hash1, hash2;
+    int c;
+    read_side_outputs(filename, width1, &color1, &hash1);
+    read_side_outputs(filename, width2, &color2, &hash2);
+    for (c=0; c < 24; c += 8) {
+        int difference = (int)((color1 >> c) & 0xff) - (int)((color2 >> c) & 0xff);
+        if (abs(difference) > 2 || abs((int)((color1 >> c) & 0xff) - (int)((expected_color >> c) & 0xff)) > 12) {
+            abort_("Average colors #%06x and #%06x differ from each other or from #%06x", color1, color2, expected_color);
+        }
+    }
+    /* Thumbnails of one image should hash alike */
+    if (__builtin_popcountll(hash1 ^ hash2) > 6) {
+        abort_("Difference hashes %016llx and %016llx are too far apart", hash1, hash2);
+    }
+}
+
+void test_16bit(const char* filename, int max_width, double max_error) {
+    printf("Testing 16-bit scaling of %s at %dpx...\n", filename, max_width);
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "./pngscale --16-bit %s " TEMP_DIR "/out.pngscale.png %d -1", filename, max_width);
+    sys(buffer);
+    struct png_info scaled = open_read_png_depth(TEMP_DIR "/out.pngscale.png", 1);
+    if (scaled.bit_depth != 16) {
+        abort_("Expected a 16-bit output but got %d bits per sample", scaled.bit_depth);
+    }
+    fclose(scaled.fp);
+
+    /* Requires ImageMagick convert, which keeps 16-bit samples */
+    snprintf(buffer, sizeof(buffer), "convert %s -resize %d " TEMP_DIR "/out.convert.png", filename, max_width);
+    sys(buffer);
+    double difference = png_compare_16(TEMP_DIR "/out.pngscale.png", TEMP_DIR "/out.convert.png");
+    if (difference > max_error) {
+        abort_("16-bit outputs differ too much from convert (distance=%f, threshold=%f).", difference, max_error);
+    }
+
+    /* The 8-bit output may differ from it by no more than rounding */
+    snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.8bit.png %d -1", filename, max_width);
+    sys(buffer);
+    difference = png_compare_16(TEMP_DIR "/out.pngscale.png", TEMP_DIR "/out.pngscale.8bit.png");
+    if (difference > 1.0) {
+        abort_("16-bit and 8-bit outputs differ by more than rounding (distance=%f).", difference);
+    }
+    unlink(TEMP_DIR "/out.pngscale.png");
+    unlink(TEMP_DIR "/out.convert.png");
+    unlink(TEMP_DIR "/out.pngscale.8bit.png");
+}
+
+void test_sheet(const char** filenames, int count, int columns, int tile_width, int tile_height) {
+    printf("Testing a contact sheet of %d images in %d columns...\n", count, columns);
+    char buffer[4096];
+    char line[1024];
+    int i, x, y;
+    int n = snprintf(buffer, sizeof(buffer), "./pngscale --sheet %d " TEMP_DIR "/out.pngscale.sheet.png", columns);
+    for (i=0; i < count; i++) {
+        n += snprintf(buffer + n, sizeof(buffer) - n, " %s", filenames[i]);
+    }
+    snprintf(buffer + n, sizeof(buffer) - n, " %d %d > " TEMP_DIR "/out.pngscale.sheet.json", tile_width, tile_height);
+    sys(buffer);
+
+    struct png_info sheet = open_read_png(TEMP_DIR "/out.pngscale.sheet.png");
+    int bands = (count + columns - 1) / columns;
+    if (sheet.width != columns * tile_width || sheet.height != bands * tile_height || sheet.channels != 4) {
+        abort_("Contact sheet is %dx%d with %d channels", sheet.width, sheet.height, sheet.channels);
+    }
+    png_bytep sheet_pixels = (png_bytep) malloc((size_t)sheet.rowbytes * sheet.height);
+    for (y=0; y < sheet.height; y++) {
+        png_read_row(sheet.png_ptr, sheet_pixels + (size_t)y * sheet.rowbytes, NULL);
+    }
+    close_read_png(sheet);
+
+    /* Each cell must hold exactly what scaling the input alone gives */
+    FILE* fp = fopen(TEMP_DIR "/out.pngscale.sheet.json", "r");
+    if (!fp) {
+        abort_("Could not open " TEMP_DIR "/out.pngscale.sheet.json");
+    }
+    for (i=0; i < count; i++) {
+        int tile_x, tile_y, width, height;
+        char* position;
+        if (!fgets(line, sizeof(line), fp) || !(position = strstr(line, "\"x\":")) ||
+            sscanf(position, "\"x\":%d,\"y\":%d,\"width\":%d,\"height\":%d", &tile_x, &tile_y, &width, &height) != 4) {
+            abort_("Could not parse position of %s", filenames[i]);
+        }
+        if (tile_x / tile_width != i % columns || tile_y / tile_height != i / columns) {
+            abort_("%s placed in the wrong cell", filenames[i]);
+        }
+        snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.png %d %d", filenames[i], width, height);
+        sys(buffer);
+        struct png_info tile = open_read_png(TEMP_DIR "/out.pngscale.png");
+        png_bytep row = (png_bytep) malloc(tile.rowbytes);
+        for (y=0; y < height; y++) {
+            png_read_row(tile.png_ptr, row, NULL);
+            for (x=0; x < width; x++) {
+                png_bytep in = &(row[x*tile.channels]);
+                png_bytep out = &(sheet_pixels[(size_t)(tile_y + y) * sheet.rowbytes + (tile_x + x) * 4]);
+                int gray = tile.channels < 3;
+                png_byte expected[4] = { in[0], in[gray ? 0 : 1], in[gray ? 0 : 2],
+                                         tile.channels % 2 == 0 ? in[tile.channels - 1] : 255 };
+                if (memcmp(out, expected, 4) != 0) {
+                    abort_("Cell of %s differs at %d,%d", filenames[i], x, y);
+                }
+            }
+        }
+        free(row);
+        close_read_png(tile);
+    }
+    fclose(fp);
+    free(sheet_pixels);
+    unlink(TEMP_DIR "/out.pngscale.sheet.png");
+    unlink(TEMP_DIR "/out.pngscale.sheet.json");
+    unlink(TEMP_DIR "/out.pngscale.png");
+}
+
+/* Loads a whole image, for checks that need to look at it out of order */
+png_bytep read_png_pixels(const char* filename, struct png_info* info) {
+    int y;
+    *info = open_read_png(filename);
+    png_bytep pixels = (png_bytep) malloc((size_t)info->rowbytes * info->height);
+    for (y=0; y < info->height; y++) {
+        png_read_row(info->png_ptr, pixels + (size_t)y * info->rowbytes, NULL);
+    }
+    close_read_png(*info);
+    return pixels;
+}
+
+/* Copies a PNG, adding an eXIf chunk that records the given orientation */
+void write_png_with_exif(const char* read_filename, const char* write_filename, int orientation, int big_endian) {
+    /* TIFF header, then an IFD with just the Orientation tag */
+    png_byte exif[26] = { 'I', 'I', 42, 0, 8, 0, 0, 0,  1, 0,  0x12, 0x01, 3, 0, 1, 0, 0, 0, orientation, 0, 0, 0,  0, 0, 0, 0 };
+    png_byte exif_big_endian[26] = { 'M', 'M', 0, 42, 0, 0, 0, 8,  0, 1,  0x01, 0x12, 0, 3, 0, 0, 0, 1, 0, orientation, 0, 0,  0, 0, 0, 0 };
+    int y;
+    struct png_info read = open_read_png(read_filename);
+    FILE* fp = fopen(write_filename, "wb");
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!fp || !png_ptr || !info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+        abort_("Could not write %s", write_filename);
+    }
+    png_init_io(png_ptr, fp);
+    png_set_IHDR(png_ptr, info_ptr, read.width, read.height, 8, read.color_type & ~PNG_COLOR_MASK_PALETTE,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_set_eXIf_1(png_ptr, info_ptr, sizeof(exif), big_endian ? exif_big_endian : exif);
+    png_write_info(png_ptr, info_ptr);
+    png_bytep row = (png_bytep) malloc(read.rowbytes);
+    for (y=0; y < read.height; y++) {
+        png_read_row(read.png_ptr, row, NULL);
+        png_write_row(png_ptr, row);
+    }
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    fclose(fp);
+    close_read_png(read);
+    free(row);
+}
+
+void test_orientation(const char* filename, int width) {
+    printf("Testing rotation and flips of %s...\n", filename);
+    char buffer[1024];
+    struct { const char* options; int orientation; } cases[] = {
+        { "--flip horizontal", 2 }, { "--rotate 180", 3 }, { "--flip vertical", 4 },
+        { "--rotate 90 --flip horizontal", 5 }, { "--rotate 90", 6 },
+        { "--rotate 270 --flip horizontal", 7 }, { "--rotate 270", 8 },
+        { "--flip vertical --rotate 180", 2 }, { "--rotate 90 --rotate 270", 1 }
+    };
+    int i, x, y;
+
+    snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.png %d -1", filename, width);
+    sys(buffer);
+    struct png_info scaled;
+    png_bytep scaled_pixels = read_png_pixels(TEMP_DIR "/out.pngscale.png", &scaled);
+    int w = scaled.width, h = scaled.height;
+
+    for (i=0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+        int transposed = cases[i].orientation >= 5;
+        if (transposed) {
+            snprintf(buffer, sizeof(buffer), "./pngscale %s %s " TEMP_DIR "/out.pngscale.2.png -1 %d", cases[i].options, filename, width);
+        } else {
+            snprintf(buffer, sizeof(buffer), "./pngscale %s %s " TEMP_DIR "/out.pngscale.2.png %d -1", cases[i].options, filename, width);
+        }
+        sys(buffer);
+        struct png_info oriented;
+        png_bytep oriented_pixels = read_png_pixels(TEMP_DIR "/out.pngscale.2.png", &oriented);
+        if (oriented.width != (transposed ? h : w) || oriented.height != (transposed ? w : h)) {
+            abort_("'%s' produced a %dx%d image from %dx%d", cases[i].options, oriented.width, oriented.height, w, h);
+        }
+        for (y=0; y < oriented.height; y++) {
+            for (x=0; x < oriented.width; x++) {
+                int source_x = x, source_y = y;
+                switch (cases[i].orientation) {
+                case 2: source_x = w - 1 - x; break;
+                case 3: source_x = w - 1 - x; source_y = h - 1 - y; break;
+                case 4: source_y = h - 1 - y; break;
+                case 5: source_x = y; source_y = x; break;
+                case 6: source_x = y; source_y = h - 1 - x; break;
+                case 7: source_x = w - 1 - y; source_y = h - 1 - x; break;
+                case 8: source_x = w - 1 - y; source_y = x; break;
+                }
+                if (memcmp(oriented_pixels + (size_t)y * oriented.rowbytes + x * oriented.channels,
+                           scaled_pixels + (size_t)source_y * scaled.rowbytes + source_x * scaled.channels,
+                           scaled.channels) != 0) {
+                    abort_("'%s' misplaced the pixel at %d,%d", cases[i].options, x, y);
+                }
+            }
+        }
+        free(oriented_pixels);
+
+        /* An eXIf orientation must give the same result as the options */
+        if (cases[i].orientation != 1) {
+            write_png_with_exif(filename, TEMP_DIR "/out.exif.png", cases[i].orientation, i % 2);
+            snprintf(buffer, sizeof(buffer), "./pngscale --auto-orient " TEMP_DIR "/out.exif.png " TEMP_DIR "/out.pngscale.3.png %d %d",
+                     transposed ? -1 : width, transposed ? width : -1);
+            sys(buffer);
+            sys("cmp -s " TEMP_DIR "/out.pngscale.2.png " TEMP_DIR "/out.pngscale.3.png");
+        }
+    }
+
+    /* --rotate and --flip apply after the eXIf orientation */
+    write_png_with_exif(filename, TEMP_DIR "/out.exif.png", 6, 0);
+    snprintf(buffer, sizeof(buffer), "./pngscale --auto-orient --rotate 90 " TEMP_DIR "/out.exif.png " TEMP_DIR "/out.pngscale.2.png %d -1", width);
+    sys(buffer);
+    snprintf(buffer, sizeof(buffer), "./pngscale --rotate 180 %s " TEMP_DIR "/out.pngscale.3.png %d -1", filename, width);
+    sys(buffer);
+    sys("cmp -s " TEMP_DIR "/out.pngscale.2.png " TEMP_DIR "/out.pngscale.3.png");
+    test_probe("--auto-orient --rotate 90", TEMP_DIR "/out.exif.png", width, -1);
+    test_probe("--auto-orient --flip horizontal", TEMP_DIR "/out.exif.png", -1, width);
+
+    free(scaled_pixels);
+    unlink(TEMP_DIR "/out.exif.png");
+    unlink(TEMP_DIR "/out.pngscale.png");
+    unlink(TEMP_DIR "/out.pngscale.2.png");
+    unlink(TEMP_DIR "/out.pngscale.3.png");
+}
+
+void test_approximate(const char* filename, int width, double max_error) {
+    printf("Testing approximate scaling of %s to width %d...\n", filename, width);
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "./pngscale --probe --approximate %s %d -1 | grep -q '\"scaler\":\"down_sampled\"'", filename, width);
+    sys(buffer);
+    snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.png %d -1", filename, width);
+    sys(buffer);
+    snprintf(buffer, sizeof(buffer), "./pngscale --approximate %s " TEMP_DIR "/out.pngscale.2.png %d -1", filename, width);
+    sys(buffer);
+    assert_png_approx_equal(TEMP_DIR "/out.pngscale.png", TEMP_DIR "/out.pngscale.2.png", max_error);
+    /* The samples taken must not vary from run to run */
+    snprintf(buffer, sizeof(buffer), "./pngscale --approximate %s " TEMP_DIR "/out.pngscale.3.png %d -1", filename, width);
+    sys(buffer);
+    sys("cmp -s " TEMP_DIR "/out.pngscale.2.png " TEMP_DIR "/out.pngscale.3.png");
+    unlink(TEMP_DIR "/out.pngscale.png");
+    unlink(TEMP_DIR "/out.pngscale.2.png");
+    unlink(TEMP_DIR "/out.pngscale.3.png");
+}
+
+/* Every pixel the image covers at all must keep its color, however
+   little of it is covered and however small the output */
+void test_translucent(const char* filename, int width, int height, unsigned int expected_color) {
+    printf("Testing colors of translucent pixels in %s at %dx%d...\n", filename, width, height);
+    char buffer[256];
+    struct png_info scaled;
+    int x, y, c;
+    snprintf(buffer, sizeof(buffer), "./pngscale %s " TEMP_DIR "/out.pngscale.png %d %d", filename, width, height);
+    sys(buffer);
+    png_bytep pixels = read_png_pixels(TEMP_DIR "/out.pngscale.png", &scaled);
+    for (y=0; y < scaled.height; y++) {
+        for (x=0; x < scaled.width; x++) {
+            png_bytep pixel = pixels + (size_t)y * scaled.rowbytes + x * scaled.channels;
+            if (pixel[3] == 0) {
+                continue;
+            }
+            for (c=0; c < 3; c++) {
+                int expected = (expected_color >> (16 - 8*c)) & 0xff;
+                if (abs((int)pixel[c] - expected) > 2) {
+                    abort_("Pixel (%d, %d) has color #%02x%02x%02x, expected #%06x",
+                           x, y, pixel[0], pixel[1], pixel[2], expected_color);
+                }
+            }
+        }
+    }
+    free(pixels);
+    unlink(TEMP_DIR "/out.pngscale.png");
+}
+
 int main(void) {
     int i;
     int sizes[] = { 1, 50, 150, 200, 220, 300, 400, 1000 };
@@ -125,11 +692,75 @@ int main(void) {
     test_basic("test/data/Abrams-transparent.png", 220, 6.0);
     test_basic("test/data/Abrams-transparent.gray.png", 220, 15.0);
     test_basic("test/data/Abrams-transparent_palette_256.png", 220, 5.0);
+    test_translucent("test/data/translucent_circle.png", 5, 3, 0xff0000);
+    test_translucent("test/data/translucent_circle.png", 37, 29, 0xff0000);
     test_basic("test/data/translucent_circle.png", 220, 5.0);
 
     /* Upscaling - introduces blurring, use larger error */
     test_upscale("test/data/ferriero.png", 100, 800, 10.0);
 
+    /* Mixed scaling - box filter on one axis, interpolation on the other */
+    test_mixed("test/data/ferriero.png", 400, 4000, 10.0);
+    test_mixed("test/data/ferriero.png", 4000, 400, 10.0);
+    test_mixed("test/data/translucent_circle.png", 200, 1500, 10.0);
+    test_mixed("test/data/translucent_circle.png", 1500, 200, 10.0);
+
+    /* Result cache */
+    test_cache("test/data/ferriero.png", 220);
+    test_cache_eviction("test/data/Abrams-transparent.png", 1000);
+
+    /* Probe mode must predict the output size */
+    test_probe("", "test/data/ferriero.png", 220, -1);
+    test_probe("", "test/data/ferriero_palette_bw.png", -1, 97);
+    test_probe("", "test/data/Abrams-transparent_palette_256.png", 220, -1);
+    test_probe("", "test/data/translucent_circle.png", 300, 200);
+    test_probe("--rotate 90", "test/data/Abrams-transparent.png", 200, -1);
+    test_probe("--flip vertical --rotate 270", "test/data/ferriero.png", -1, 150);
+    test_probe_invalid_length("test/data/translucent_circle.png");
+
+    /* Standalone comparison tool */
+    test_pngcompare("test/data/ferriero.png");
+    test_pngcompare("test/data/translucent_circle.png");
+
+    /* Column strips on very wide images */
+    test_threads("test/data/ferriero.png", 100003, 997, 4);
+    test_threads("test/data/translucent_circle.png", 100003, 1203, 7);
+    test_threads("test/data/ferriero_palette_16.png", 60001, 997, 3);
+
+    /* Whole-number reduction ratios take a separate path */
+    test_integer_ratio("test/data/ferriero.png", 800, 600, 2, 5.0);
+    test_integer_ratio("test/data/ferriero.png", 400, 300, 4, 5.0);
+    test_integer_ratio("test/data/ferriero_gray.png", 200, 150, 8, 5.0);
+    test_integer_ratio("test/data/ferriero.png", 300, 200, 3, 5.0);
+
+    /* Scaling an input that is still arriving */
+    test_tail("test/data/ferriero.png", 300);
+    test_tail("test/data/translucent_circle.png", 150);
+
+    /* Average color, placeholder and hash from the scaling pass */
+    test_side_outputs("test/data/ferriero.png", 300, 57, 0xa18b79);
+    test_side_outputs("test/data/translucent_circle.png", 300, 7, 0xff0000);
+
+    /* Full-precision path for 16-bit inputs */
+    test_16bit("test/data/ferriero_16bit.png", 220, 5.0);
+    test_16bit("test/data/ferriero_16bit.png", 1000, 5.0);
+
+    /* Contact sheet of mixed color types, with an incomplete last band */
+    const char* sheet_files[] = { "test/data/ferriero.png", "test/data/translucent_circle.png",
+                                  "test/data/ferriero_gray.png", "test/data/Abrams-transparent.png",
+                                  "test/data/ferriero_palette_bw.png" };
+    test_sheet(sheet_files, 5, 3, 64, 48);
+
+    test_orientation("test/data/Abrams-transparent.png", 200);
+    test_orientation("test/data/ferriero.png", 333);
+
+    /* Sampled downscaling must stay close to the exact result */
+    test_approximate("test/data/ferriero.png", 50, 3.0);
+    test_approximate("test/data/antonio.png", 64, 3.0);
+    test_approximate("test/data/ferriero_palette_bw.png", 40, 3.0);
+    test_approximate("test/data/Abrams-transparent.png", 20, 3.0);
+    test_approximate("test/data/translucent_circle.png", 12, 3.0);
+
     printf("\nAll tests passed.\n");
     return 0;
 }
@@ -27,5 +27,7 @@ under MIT/X11 License at http://zarb.org/~gc/html/libpng.html
 #define _UTILS_H_
 
 void abort_(const char * s, ...);
+void warn_(const char * s, ...);
+void print_json_string(const char* s);
 
 #endif /* #ifndef _UTILS_H_ */